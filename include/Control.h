@@ -20,17 +20,65 @@
 #ifndef CONTROL_H
 #define CONTROL_H
 
+#include <algorithm>
+#include <vector>
 #include "types.h"
 
 namespace dice {
 template<typename Value, typename Time, typename Constant = Value, typename Variable = TimeSeries<Value>>
 class Control {
+  protected:
+    // Variables at the last reset
+    std::vector<Constant> reset_mu;
+    std::vector<Constant> reset_s;
+
+    static inline Time first_change(const std::vector<Constant>& current, const std::vector<Constant>& previous) {
+        if (current.size() != previous.size()) {
+            return 0;
+        }
+        return std::mismatch(std::begin(current), std::end(current), std::begin(previous)).first - std::begin(current);
+    }
+
   public:
+    // If the emission control rates are control variables as well, the variables of s and mu alternate, so that values at a timestep only depend
+    // on the first variables (as for s alone)
+    const bool mu_variables;
+    const size_t stride;
     const size_t variables_num;
-    Variable mu{variables_num, variables_num, variables_num, 0};  // Emission control rate GHGs
-    Variable s{0, variables_num, variables_num, 0};               // Gross savings rate as fraction of gross world product
+    Variable mu{mu_variables ? 1 : variables_num, variables_num, variables_num / stride, 0, 2};  // Emission control rate GHGs
+    Variable s{0, variables_num, variables_num / stride, 0, stride};  // Gross savings rate as fraction of gross world product
+
+    Control(Time length, bool mu_variables_p = false)
+        : mu_variables(mu_variables_p), stride(mu_variables_p ? 2 : 1), variables_num(stride * length){};
+
+    // Indices of the variables of s and mu at t among all variables (e.g. in derivatives)
+    inline size_t s_index(Time t) const {
+        return stride * t;
+    }
+    inline size_t mu_index(Time t) const {
+        return 2 * t + 1;
+    }
+
+    // Earliest timestep whose variables changed since the last reset (the number of timesteps if none did), always 0 if values calculated before
+    // cannot be kept by the Variable type
+    Time changed_from() {
+        if (!Variable::incremental) {
+            return 0;
+        }
+        return std::min(first_change(mu.value(), reset_mu), first_change(s.value(), reset_s));
+    }
 
-    Control(Time length) : variables_num(length){};  // TODO mu
+    void reset() {
+        Variable::rewind(variables_num);
+        if (Variable::incremental) {
+            reset_mu = mu.value();
+            reset_s = s.value();
+        }
+    }
+
+    inline Value constant(const Constant& val) const {
+        return ConstantValue<Value, Constant>::create(variables_num, val);
+    }
 
     bool observe(Observer<Value, Time, Constant>& observer) {
         OBSERVE_VARIABLE(mu);
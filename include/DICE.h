@@ -20,15 +20,13 @@
 #ifndef DICE_H
 #define DICE_H
 
+#include <autodiff-reverse.h>
 #include <autodiff.h>
 #include <memory>
+#include <random>
 #include <vector>
-#include "Climate.h"
-#include "Control.h"
-#include "Damage.h"
-#include "Economy.h"
-#include "Emissions.h"
 #include "Global.h"
+#include "Model.h"
 
 namespace settings {
 class SettingsNode;
@@ -47,31 +45,67 @@ class Optimization;
 template<typename Value, typename Time>
 class DICE {
   protected:
+    // Forward-mode derivatives only store the range of control variables a value actually depends on, their storage is recycled by a thread-local
+    // arena
+    using ForwardVector = autodiff::RangeVector<Value, autodiff::ArenaAllocator<Value>>;
+    using ForwardValue = autodiff::Value<Value, ForwardVector>;
+    using ForwardVariable = autodiff::Variable<Value, ForwardVector>;
+    // For common short horizons, forward-mode derivatives are dense vectors of fixed size instead (for long ones, the ranges stored otherwise are
+    // sparse enough to be faster)
+    template<size_t N>
+    using FixedForwardValue = autodiff::Value<Value, autodiff::FixedDerivative<Value, N>>;
+    template<size_t N>
+    using FixedForwardVariable = autodiff::Variable<Value, autodiff::FixedDerivative<Value, N>>;
+
     const settings::SettingsNode& settings;
     const Global<Value, Time> global;
+    bool dice_modules = false;  // Whether the configured modules are composed at compile time (see DICEModules), decided in initialize()
 
   public:
-    Control<autodiff::Value<Value>, Time, Value, autodiff::Variable<Value>> control;
+    Model<ForwardValue, Time, Value, ForwardVariable> model;
 
   protected:
-    std::vector<Economy<autodiff::Value<Value>, Time, Value, autodiff::Variable<Value>>> economies;
-    std::unique_ptr<climate::Climate<autodiff::Value<Value>, Time, Value, autodiff::Variable<Value>>> climate;
-    std::unique_ptr<damage::Damage<autodiff::Value<Value>, Time, Value, autodiff::Variable<Value>>> damage;
-
+    template<template<typename, typename, typename, typename, template<typename, typename, typename, typename> class> class M,
+             typename V,
+             typename Variable,
+             typename... Args>
+    std::unique_ptr<ModelBase<Value, Time>> create_model(Args... args);
+    std::unique_ptr<ModelBase<Value, Time>> create_optimization_model(const settings::SettingsNode& optimization_node);
+    std::unique_ptr<ModelBase<Value, Time>> create_reverse_model(bool checkpointed);
+    std::unique_ptr<ModelBase<Value, Time>> create_value_model();
+    std::unique_ptr<ModelBase<Value, Time>> create_hessian_model();
+    std::unique_ptr<ModelBase<Value, Time>> create_directional_model();
 #ifdef DICEPP_WITH_NETCDF
     void write_netcdf_output(const settings::SettingsNode& output_node);
 #endif
     void write_csv_output(const settings::SettingsNode& output_node);
+    // Evaluates the main run with the emission control rate after a common timestep set to each of the values given, continuing from a snapshot
+    // taken there instead of calculating the common timesteps anew (and checking against the latter in DEBUG builds)
+    void run_branches(const settings::SettingsNode& branches_node);
+    std::vector<TimeSeries<Value>> create_starts(const Optimization<Value, Time>& optimization,
+                                                 const settings::SettingsNode& iteration_node,
+                                                 const TimeSeries<Value>& initial_values,
+                                                 Time s_num,
+                                                 std::mt19937& random);
     void single_optimization(Optimization<Value, Time>& optimization,
+                             ModelBase<Value, Time>& optimization_model,
+                             const std::vector<ModelBase<Value, Time>*>& auxiliary_models,
                              const settings::SettingsNode& optimization_node,
                              TimeSeries<Value>& initial_values,
+                             Time s_num,
+                             Time mu_first,
                              bool verbose);
 
   public:
+    using Snapshot = std::shared_ptr<const dice::Snapshot<ForwardValue, Time, Value>>;
+
     DICE(const settings::SettingsNode& settings_p);
-    inline autodiff::Value<Value> calc_single_utility();
-    Emissions<autodiff::Value<Value>, Time, Value, autodiff::Variable<Value>> emissions;
     void reset();
+    // Captures the values of the model up to t, so that runs differing only after t (e.g. branches of a scenario tree) can continue from there
+    Snapshot snapshot(Time t);
+    // Sets the control variables up to the timestep of the snapshot to its ones, while those after it are kept as set by the caller (so a branch is
+    // chosen by changing them after restoring)
+    void restore(const Snapshot& snapshot);
     void initialize();
     void output();
     void run();
@@ -22,23 +22,32 @@
 
 #include <math.h>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include "Climate.h"
 #include "Control.h"
 #include "Damage.h"
+#include "EquationGraph.h"
 #include "Global.h"
+#include "Modules.h"
 #include "settingsnode.h"
 #include "types.h"
 
 namespace dice {
 
-template<typename Value, typename Time, typename Constant = Value, typename Variable = TimeSeries<Value>>
+template<typename Value,
+         typename Time,
+         typename Constant = Value,
+         typename Variable = TimeSeries<Value>,
+         typename Modules = DynamicModules<Value, Time, Constant, Variable>>
 class Economy {
   protected:
     const settings::SettingsNode& settings;
     const Control<Value, Time, Constant, Variable>& control;
     const Global<Constant, Time>& global;
-    climate::Climate<Value, Time, Constant, Variable>& climate;
-    damage::Damage<Value, Time, Constant, Variable>& damage;
+    StateBlock<Value, Time>& state_block;
+    typename Modules::Climate& climate;
+    typename Modules::Damage& damage;
 
     const Constant C_lower{settings["C_lower"].template as<Constant>()};
     const Constant C_pc_lower{settings["C_pc_lower"].template as<Constant>()};
@@ -63,27 +72,224 @@ class Economy {
     const Constant Q0{settings["Q0"].template as<Constant>()};                          // Initial gross output (trill 2005 USD)
     const Constant tnopol{settings["tnopol"].template as<Constant>()};                  // Period before which no emissions controls base
 
-    StepwiseBackwardLookingTimeSeries<Constant, Time> L_series{global.timestep_num, settings["L0"].template as<Constant>()};
-    StepwiseBackwardLookingTimeSeries<Constant, Time> A_series{global.timestep_num, settings["A0"].template as<Constant>()};
-    StepwiseBackwardLookingTimeSeries<LowerBounded<Value>, Time> K_series{
-        global.timestep_num,
-        {{control.variables_num, settings["K0"].template as<Constant>()}, {control.variables_num, settings["K_lower"].template as<Constant>()}}};
-    StepwiseBackwardLookingTimeSeries<Value, Time> cca_series{global.timestep_num, {control.variables_num, settings["cca0"].template as<Constant>()}};
+    const Constant L0{settings["L0"].template as<Constant>()};  // Initial population (millions)
+    const Constant A0{settings["A0"].template as<Constant>()};  // Initial level of total factor productivity
+
+    // Exogenous series, calculated once by initialize() and shared with the economies of clones of the model
+    struct Tables {
+        TimeSeries<Constant> L;
+        TimeSeries<Constant> A;
+        TimeSeries<Constant> sigma;
+        TimeSeries<Constant> rr;
+        TimeSeries<Constant> E_tree;
+        TimeSeries<Constant> cost1;
+        TimeSeries<Constant> partfract;
+        TimeSeries<Constant> cpricebase;
+        TimeSeries<Constant> pbacktime;
+    };
+    std::shared_ptr<const Tables> tables;
+    StateSeries<Value, Time, LowerBounded<Value, Constant>> K_series{
+        state_block, control.constant(settings["K0"].template as<Constant>()), control.constant(settings["K_lower"].template as<Constant>())};
+    StateSeries<Value, Time> cca_series{state_block, control.constant(settings["cca0"].template as<Constant>())};
+    // Equations used by several others, invalidated together with the capital stock (the states of the climate, on which Y also depends, are
+    // always invalidated and restored at the same timesteps)
+    MemoizedTimeSeries<Value, Time> Y_gross_series{global.timestep_num, control.constant(0)};
+    MemoizedTimeSeries<Value, Time> Y_series{global.timestep_num, control.constant(0)};
+
+    // The equations at timestep t given the values they depend on, used by both the lazy accessors below and the eager evaluation (advance() and
+    // evaluate())
+    Value K_equation(const Value& K_last, const Value& I_last) const {
+        return std::pow(1 - global.dK, global.timestep_length) * K_last + global.timestep_length * I_last;
+    }
+    Value cca_equation(const Value& cca_last, const Value& E_ind_last) const {
+        return cca_last + global.timestep_length * E_ind_last / 3.666;
+    }
+    Value Y_gross_equation(Time t, const Value& K_t) {
+        return A(t) * std::pow(L(t) / 1000, 1 - global.gamma) * std::pow(K_t, global.gamma);
+    }
+    Value Y_net_equation(const Value& Y_gross_t, const Value& damfrac_t) const {
+        return Y_gross_t * (1 - damfrac_t);
+    }
+    Value abatecost_equation(Time t, const Value& Y_gross_t) {
+        return Y_gross_t * cost1(t) * std::pow(control.mu[t], global.expcost2) * std::pow(partfract(t), 1 - global.expcost2);
+    }
+    Value Y_equation(const Value& Y_net_t, const Value& abatecost_t) const {
+        return Y_net_t - abatecost_t;
+    }
+    Value I_equation(Time t, const Value& Y_t) const {
+        return control.s[t] * Y_t;
+    }
+    Value E_ind_equation(Time t, const Value& Y_gross_t) {
+        return sigma(t) * Y_gross_t * (1 - control.mu[t]);
+    }
+    Value E_equation(Time t, const Value& E_ind_t) {
+        return E_ind_t + E_tree(t);
+    }
+    Value C_equation(const Value& Y_t, const Value& I_t) const {
+        return std::max(C_lower, Y_t - I_t);
+    }
+    Value periodu_equation(Time t, const Value& C_t) {
+        return (std::pow(C_t / (L(t) / 1000), 1 - global.elasmu) - 1) / (1 - global.elasmu) - 1;
+    }
+    Value utility_equation(Time t, const Value& periodu_t) {
+        return periodu_t * (L(t) * rr(t));
+    }
+
+  public:
+    // Equations at the timestep last evaluated by evaluate()
+    struct Flows {
+        Value I;
+        Value E_ind;
+        Value E;
+        Value utility;
+    };
+
+  protected:
+    Flows flows{control.constant(0), control.constant(0), control.constant(0), control.constant(0)};
+#ifdef DEBUG
+    Time flows_t = 0;
+    bool flows_valid = false;
+    void check_flows(Time t) const {
+        if (!flows_valid || flows_t != t) {
+            throw std::runtime_error("flows read before being evaluated");
+        }
+    }
+#else
+    void check_flows(Time /* t */) const {}
+#endif
 
   public:
     Economy(const settings::SettingsNode& settings_p,
             const Global<Constant, Time>& global_p,
             const Control<Value, Time, Constant, Variable>& control_p,
-            climate::Climate<Value, Time, Constant, Variable>& climate_p,
-            damage::Damage<Value, Time, Constant, Variable>& damage_p)
-        : settings(settings_p), global(global_p), control(control_p), climate(climate_p), damage(damage_p) {
+            StateBlock<Value, Time>& state_block_p,
+            typename Modules::Climate& climate_p,
+            typename Modules::Damage& damage_p)
+        : settings(settings_p), global(global_p), control(control_p), state_block(state_block_p), climate(climate_p), damage(damage_p) {
+    }
+
+    // The exogenous series only depend on the parameters, hence taken from prototype if given (an initialized economy with the same settings)
+    void initialize(const Economy* prototype = nullptr) {
+        if (prototype) {
+            tables = prototype->tables;
+            return;
+        }
+        const Time n = global.timestep_num;
+        std::shared_ptr<Tables> res = std::make_shared<Tables>();
+        res->L.resize(n);
+        res->A.resize(n);
+        res->sigma.resize(n);
+        res->rr.resize(n);
+        res->E_tree.resize(n);
+        res->cost1.resize(n);
+        res->partfract.resize(n);
+        res->cpricebase.resize(n);
+        res->pbacktime.resize(n);
+        const Constant sig0 = E0 / (Q0 * (1 - mu0));  // Carbon intensity 2010 (kgCO2 per output 2005 USD 2010)
+        for (Time t = 0; t < n; ++t) {
+            if (t == 0) {
+                res->L[t] = L0;
+                res->A[t] = A0;
+            } else {
+                res->L[t] = std::pow(L0, std::pow(1 - pop_adj, global.timestep_length * 0.2 * t)) * pop_asym
+                            * std::pow(pop_asym, -std::pow(1 - pop_adj, global.timestep_length * 0.2 * t));
+                const Constant gA_t_m1 = gA0 * std::exp(-dA * global.timestep_length * (t - 1));
+                res->A[t] = res->A[t - 1] / (1 - gA_t_m1);
+            }
+            res->sigma[t] =
+                sig0 * std::exp(5 / global.timestep_length * gsigma1 * (1 - std::pow(1 + dsig, t)) / (1 - std::pow(1 + dsig, 5 / global.timestep_length)));
+            res->rr[t] = 1 / std::pow(1 + global.prstp, t);
+            res->E_tree[t] = E_land0 * std::pow(1 - dE_land, 0.2 * global.timestep_length * t);
+            res->pbacktime[t] = pback * std::pow(1 - gback, 0.2 * global.timestep_length * t);
+            res->cost1[t] = res->pbacktime[t] * res->sigma[t] / global.expcost2 / 1000;
+            if (t > periodfullpart) {
+                res->partfract[t] = partfractfull;
+            } else {
+                res->partfract[t] = partfract2010 + (partfractfull - partfract2010) * t / periodfullpart;
+            }
+            res->cpricebase[t] = cprice0 * std::pow(1 + gcprice, global.timestep_length * t);
+        }
+        tables = res;
     }
 
     void reset() {
-        L_series.reset();
-        A_series.reset();
         K_series.reset();
         cca_series.reset();
+        Y_gross_series.reset();
+        Y_series.reset();
+#ifdef DEBUG
+        flows_valid = false;
+#endif
+    }
+
+    void invalidate_after(Time t) {
+        K_series.invalidate_after(t);
+        cca_series.invalidate_after(t);
+        Y_gross_series.invalidate_from(t + 1);
+        Y_series.invalidate_from(t + 1);
+    }
+
+    // The memoized equations are not part of the states, hence calculated anew for all timesteps
+    void validate_until(Time t) {
+        K_series.validate_until(t);
+        cca_series.validate_until(t);
+        Y_gross_series.reset();
+        Y_series.reset();
+    }
+
+    // Eager evaluation (see Model::evaluate()): advances capital stock and cumulative emissions to t from the flows evaluated at t - 1
+    void advance(Time t) {
+        check_flows(t - 1);
+        K_series.restore(t, K_equation(K_series[t - 1], flows.I));
+        cca_series.restore(t, cca_equation(cca_series[t - 1], flows.E_ind));
+    }
+
+    // Eager evaluation: evaluates the equations at t once each (capital stock and climate have to be advanced to t before)
+    void evaluate(Time t) {
+        const Value Y_gross_t = Y_gross_equation(t, K_series[t]);
+        const Value Y_t = Y_equation(Y_net_equation(Y_gross_t, damage.damfrac(t)), abatecost_equation(t, Y_gross_t));
+        flows.I = I_equation(t, Y_t);
+        flows.E_ind = E_ind_equation(t, Y_gross_t);
+        flows.E = E_equation(t, flows.E_ind);
+        flows.utility = utility_equation(t, periodu_equation(t, C_equation(Y_t, flows.I)));
+#ifdef DEBUG
+        flows_t = t;
+        flows_valid = true;
+#endif
+    }
+
+    // Flows evaluated at t (checked in DEBUG builds)
+    const Flows& evaluated(Time t) const {
+        check_flows(t);
+        return flows;
+    }
+
+    void collect_equations(EquationGraph<Time>& graph, const std::string& region) {
+        const std::string p = region + "/";
+        const size_t advance_step = graph.add_step(p + "advance", 1, [this](Time t) { advance(t); });
+        graph.add(p + "K", advance_step, {{p + "K", 1}, {p + "I", 1}});
+        graph.add(p + "cca", advance_step, {{p + "cca", 1}, {p + "E_ind", 1}});
+        const size_t evaluate_step = graph.add_step(p + "evaluate", 0, [this](Time t) { evaluate(t); });
+        graph.add(p + "Y_gross", evaluate_step, {{p + "K", 0}});
+        graph.add(p + "Y_net", evaluate_step, {{p + "Y_gross", 0}, {"damfrac", 0}});
+        graph.add(p + "abatecost", evaluate_step, {{p + "Y_gross", 0}, {"mu", 0}});
+        graph.add(p + "Y", evaluate_step, {{p + "Y_net", 0}, {p + "abatecost", 0}});
+        graph.add(p + "I", evaluate_step, {{"s", 0}, {p + "Y", 0}});
+        graph.add(p + "E_ind", evaluate_step, {{p + "Y_gross", 0}, {"mu", 0}});
+        graph.add(p + "E", evaluate_step, {{p + "E_ind", 0}});
+        graph.add(p + "C", evaluate_step, {{p + "Y", 0}, {p + "I", 0}});
+        graph.add(p + "periodu", evaluate_step, {{p + "C", 0}});
+        graph.add(p + "utility", evaluate_step, {{p + "periodu", 0}});
+    }
+
+    void collect_states(std::vector<State<Value, Time>>& states) {
+        states.push_back({[this](Time t) { return K(t); },
+                          [this](Time t, const Value& v) {
+                              K_series.restore(t, v);
+                              Y_gross_series.invalidate_from(t);
+                              Y_series.invalidate_from(t);
+                          }});
+        states.push_back({[this](Time t) { return cca(t); }, [this](Time t, const Value& v) { cca_series.restore(t, v); }});
     }
 
     bool observe(Observer<Value, Time, Constant>& observer) {
@@ -118,96 +324,72 @@ class Economy {
 
     // Population (millions)
     Constant L(Time t) {
-        return L_series.get(t, [this](Time t, Constant L_last) {
-
-            return std::pow(L_series.initial_value, std::pow(1 - pop_adj, global.timestep_length * 0.2 * t)) * pop_asym
-                   * std::pow(pop_asym, -std::pow(1 - pop_adj, global.timestep_length * 0.2 * t));
-
-        });
+        return tables->L[t];
     }
 
     // Level of total factor productivity
     Constant A(Time t) {
-        return A_series.get(t, [this](Time t, Constant A_last) {
-
-            const Constant gA_t_m1 = gA0 * std::exp(-dA * global.timestep_length * (t - 1));
-            return A_last / (1 - gA_t_m1);
-
-        });
+        return tables->A[t];
     }
 
     // Capital stock (trillions 2005 US dollars)
-    Value K(Time t) {
-        return K_series.get(t, [this](Time t, const Value& K_last) {
-
-            return std::pow(1 - global.dK, global.timestep_length) * K_last + global.timestep_length * I(t - 1);
-
-        });
+    const Value& K(Time t) {
+        return K_series.get(t, [this](Time t, const Value& K_last) -> Value { return K_equation(K_last, I(t - 1)); });
     }
 
     // Cumulative industrial carbon emissions (GTC)
-    Value cca(Time t) {
-        return cca_series.get(t, [this](Time t, const Value& cca_last) {
-
-            return cca_last + global.timestep_length * E_ind(t - 1) / 3.666;
-
-        });
+    const Value& cca(Time t) {
+        return cca_series.get(t, [this](Time t, const Value& cca_last) -> Value { return cca_equation(cca_last, E_ind(t - 1)); });
     }
 
     // CO2-equivalent-emissions output ratio
     Constant sigma(Time t) {
-        const Constant sig0 = E0 / (Q0 * (1 - mu0));  // Carbon intensity 2010 (kgCO2 per output 2005 USD 2010)
-        return sig0 * std::exp(5 / global.timestep_length * gsigma1 * (1 - std::pow(1 + dsig, t)) / (1 - std::pow(1 + dsig, 5 / global.timestep_length)));
+        return tables->sigma[t];
     }
 
     // Average utility social discount rate
     Constant rr(Time t) {
-        return 1 / std::pow(1 + global.prstp, t);
+        return tables->rr[t];
     }
 
     // Emissions from deforestation
     Constant E_tree(Time t) {
-        return E_land0 * std::pow(1 - dE_land, 0.2 * global.timestep_length * t);
+        return tables->E_tree[t];
     }
 
     // Adjusted cost for backstop
     Constant cost1(Time t) {
-        const Constant pbacktime_t = pback * std::pow(1 - gback, 0.2 * global.timestep_length * t);
-        return pbacktime_t * sigma(t) / global.expcost2 / 1000;
+        return tables->cost1[t];
     }
 
     // Fraction of emissions in control regime
     Constant partfract(Time t) {
-        if (t > periodfullpart) {
-            return partfractfull;
-        } else {
-            return partfract2010 + (partfractfull - partfract2010) * t / periodfullpart;
-        }
+        return tables->partfract[t];
     }
 
     // Base Case Carbon Price
     Constant cpricebase(Time t) {
-        return cprice0 * std::pow(1 + gcprice, global.timestep_length * t);
+        return tables->cpricebase[t];
     }
 
     // Backstop price
     Constant pbacktime(Time t) {
-        return pback * std::pow(1 - gback, 0.2 * global.timestep_length * t);
+        return tables->pbacktime[t];
     }
 
     // Industrial emissions (GtCO2 per year)
     Value E_ind(Time t) {
-        return sigma(t) * Y_gross(t) * (1 - control.mu[t]);
+        return E_ind_equation(t, Y_gross(t));
     }
 
     // Investment (trillions 2005 USD per year)
     Value I(Time t) {
-        return control.s[t] * Y(t);
+        return I_equation(t, Y(t));
     }
 
     // Consumption (trillions 2005 US dollars per year)
     Value C(Time t) {
-        return std::max(C_lower, Y(t) - I(t));
+        return C_equation(Y(t), I(t));
     }
 
     // Per capita consumption (thousands 2005 USD per year)
@@ -220,23 +402,23 @@ class Economy {
         if (t < global.timestep_num - 1) {
             return (1 + global.prstp) * std::pow(C_pc(t + 1) / C_pc(t), global.elasmu) - 1;
         } else {
-            return {control.variables_num, 0.0};
+            return control.constant(0);
         }
     }
 
     // Gross world product net of abatement and damages (trillions 2005 USD per year)
-    Value Y(Time t) {
-        return Y_net(t) - abatecost(t);
+    const Value& Y(Time t) {
+        return Y_series.get(t, [this](Time t) -> Value { return Y_equation(Y_net(t), abatecost(t)); });
     }
 
     // Gross world product GROSS of abatement and damages (trillions 2005 USD per year)
-    Value Y_gross(Time t) {
-        return A(t) * std::pow(L(t) / 1000, 1 - global.gamma) * std::pow(K(t), global.gamma);
+    const Value& Y_gross(Time t) {
+        return Y_gross_series.get(t, [this](Time t) -> Value { return Y_gross_equation(t, K(t)); });
     }
 
     // Output net of damages equation (trillions 2005 USD per year)
     Value Y_net(Time t) {
-        return Y_gross(t) * (1 - damage.damfrac(t));
+        return Y_net_equation(Y_gross(t), damage.damfrac(t));
     }
 
     // Damages (trillions 2005 USD per year)
@@ -246,7 +428,17 @@ class Economy {
 
     // Cost of emissions reductions  (trillions 2005 USD per year)
     Value abatecost(Time t) {
-        return Y_gross(t) * cost1(t) * std::pow(control.mu[t], global.expcost2) * std::pow(partfract(t), 1 - global.expcost2);
+        return abatecost_equation(t, Y_gross(t));
+    }
+
+    // Upper limit of the emission control rate when optimized: 1 until 2150 and lim_mu afterwards, after tnopol also the rate at which the carbon
+    // price reaches its upper limit of 1000 (2005$ per ton CO2)
+    Constant mu_upper(Time t) {
+        Constant res = global.start_year + global.timestep_length * t > 2150 ? lim_mu : 1;
+        if (t > tnopol) {
+            res = std::min(res, partfract(t) * std::pow(1000 / pbacktime(t), 1 / (global.expcost2 - 1)));
+        }
+        return res;
     }
 
     // Marginal cost of abatement (2005$ per ton CO2)
@@ -261,16 +453,16 @@ class Economy {
 
     // One period utility function
     Value periodu(Time t) {
-        return (std::pow(C(t) / (L(t) / 1000), 1 - global.elasmu) - 1) / (1 - global.elasmu) - 1;
+        return periodu_equation(t, C(t));
     }
 
     // Total CO2 emissions (GtCO2 per year)
     Value E(Time t) {
-        return E_ind(t) + E_tree(t);
+        return E_equation(t, E_ind(t));
     }
 
     Value utility(Time t) {
-        return periodu(t) * (L(t) * rr(t));
+        return utility_equation(t, periodu(t));
     }
 };
 }
@@ -23,46 +23,76 @@
 #include <vector>
 #include "Control.h"
 #include "Economy.h"
+#include "EquationGraph.h"
 #include "Global.h"
+#include "Modules.h"
 #include "types.h"
 
 namespace dice {
 
-template<typename Value, typename Time, typename Constant = Value, typename Variable = TimeSeries<Value>>
+template<typename Value,
+         typename Time,
+         typename Constant = Value,
+         typename Variable = TimeSeries<Value>,
+         typename Modules = DynamicModules<Value, Time, Constant, Variable>>
 class Emissions {
   protected:
     const Global<Constant, Time>& global;
     const Control<Value, Time, Constant, Variable>& control;
-    std::vector<Economy<Value, Time, Constant, Variable>>& economies;
-    StepwiseBackwardLookingTimeSeries<Value, Time> E_series{global.timestep_num, {control.variables_num, 0}};
+    StateBlock<Value, Time>& state_block;
+    std::vector<typename Modules::Economy>& economies;
+    StateSeries<Value, Time> E_series{state_block, control.constant(0)};
+
+    // Sum over the economies of emissions_of(economy), used by both the lazy accessor and the eager evaluation (advance())
+    template<typename Function>
+    Value total(Function emissions_of) {
+        Value E = control.constant(0);
+        for (auto&& economy : economies) {
+            E += emissions_of(economy);
+        }
+        return E;
+    }
 
   public:
     Emissions(const Global<Constant, Time>& global_p,
               const Control<Value, Time, Constant, Variable>& control_p,
-              std::vector<Economy<Value, Time, Constant, Variable>>& economies_p)
-        : global(global_p), control(control_p), economies(economies_p){};
+              StateBlock<Value, Time>& state_block_p,
+              std::vector<typename Modules::Economy>& economies_p)
+        : global(global_p), control(control_p), state_block(state_block_p), economies(economies_p){};
 
     // Total CO2 emissions (GtCO2 per year)
-    Value operator()(Time t) {
-        return E_series.get(t, [this](Time t, Value E_last) {
-
-            Value E{control.variables_num, 0};
-            for (auto&& economy : economies) {
-                E += economy.E(t);
-            }
-            return E;
-
+    const Value& operator()(Time t) {
+        return E_series.get(t, [this](Time t, const Value& /* E_last */) {
+            return total([t](typename Modules::Economy& economy) { return economy.E(t); });
         });
     }
     void initialize() {
-        Value E{control.variables_num, 0};
-        for (auto&& economy : economies) {
-            E += economy.E(0);
-        }
-        E_series.set_first_value(E);
+        E_series.set_first_value(total([](typename Modules::Economy& economy) { return economy.E(0); }));
     }
+    // The first value depends on the control variables, so it needs to be calculated anew by initialize() afterwards
     void reset() {
         E_series.reset();
+        E_series.set_first_value(E_series.initial_value);
+    }
+    // Eager evaluation (see Model::evaluate()): sets the emissions at t from those of the economies evaluated at t
+    void advance(Time t) {
+        E_series.restore(t, total([t](typename Modules::Economy& economy) { return economy.evaluated(t).E; }));
+    }
+    void invalidate_after(Time t) {
+        E_series.invalidate_after(t);
+    }
+    void validate_until(Time t) {
+        E_series.validate_until(t);
+    }
+    void collect_equations(EquationGraph<Time>& graph, const std::vector<std::string>& regions) {
+        std::vector<Dependency<Time>> dependencies;
+        for (const auto& region : regions) {
+            dependencies.push_back({region + "/E", 0});
+        }
+        graph.add("E", graph.add_step("emissions", 0, [this](Time t) { advance(t); }), dependencies);
+    }
+    void collect_states(std::vector<State<Value, Time>>& states) {
+        states.push_back({[this](Time t) { return (*this)(t); }, [this](Time t, const Value& v) { E_series.restore(t, v); }});
     }
     bool observe(Observer<Value, Time, Constant>& observer) {
         return observer.observe("E_total", *this, global.timestep_num);
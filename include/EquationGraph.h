@@ -0,0 +1,238 @@
+/*
+  Copyright (C) 2017 Sven Willner <sven.willner@gmail.com>
+
+  This file is part of DICE++.
+
+  DICE++ is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of
+  the License, or (at your option) any later version.
+
+  DICE++ is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License
+  along with DICE++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef EQUATIONGRAPH_H
+#define EQUATIONGRAPH_H
+
+#include <algorithm>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace dice {
+
+// Dependency of an equation on the value of another one (or of an input such as a control variable) lag timesteps earlier
+template<typename Time>
+struct Dependency {
+    std::string equation;
+    Time lag;
+};
+
+// Equations of a model with their dependencies, grouped into the steps run by the eager evaluation for each timestep. The steps are scheduled
+// such that every equation an equation depends on at the same timestep has been calculated before; dependencies on earlier timesteps do not
+// constrain the order. Equations without a step (inputs, or equations calculated on demand within the steps using them) pass their
+// dependencies on to their users.
+template<typename Time>
+class EquationGraph {
+  public:
+    static const size_t no_step = static_cast<size_t>(-1);
+    struct Step {
+        std::string name;
+        Time first;  // First timestep the step is run for (1 for steps advancing states from the previous timestep)
+        std::function<void(Time)> run;
+    };
+
+  protected:
+    struct Equation {
+        std::string name;
+        size_t step;
+        std::vector<Dependency<Time>> dependencies;
+    };
+    std::vector<Step> steps;
+    std::vector<Equation> equations;
+    std::unordered_map<std::string, size_t> indices;
+
+    size_t index(const std::string& name) const {
+        const auto it = indices.find(name);
+        if (it == std::end(indices)) {
+            throw std::runtime_error("unknown equation '" + name + "'");
+        }
+        return it->second;
+    }
+
+    // Length of the longest chain of dependencies at the same timestep leading to equation i
+    size_t level(size_t i, std::vector<size_t>& levels, std::vector<size_t>& path) const {
+        static const size_t unknown = static_cast<size_t>(-1);
+        if (levels[i] != unknown) {
+            return levels[i];
+        }
+        if (std::find(std::begin(path), std::end(path), i) != std::end(path)) {
+            std::string loop;
+            for (auto it = std::find(std::begin(path), std::end(path), i); it != std::end(path); ++it) {
+                loop += equations[*it].name + " -> ";
+            }
+            throw std::runtime_error("equation loop: " + loop + equations[i].name);
+        }
+        path.push_back(i);
+        size_t res = 0;
+        for (const auto& dependency : equations[i].dependencies) {
+            const size_t j = index(dependency.equation);  // Also checks dependencies on earlier timesteps
+            if (dependency.lag == 0) {
+                res = std::max(res, level(j, levels, path) + 1);
+            }
+        }
+        path.pop_back();
+        levels[i] = res;
+        return res;
+    }
+
+    std::vector<size_t> levels() const {
+        std::vector<size_t> res(equations.size(), static_cast<size_t>(-1));
+        std::vector<size_t> path;
+        for (size_t i = 0; i < equations.size(); ++i) {
+            level(i, res, path);
+        }
+        return res;
+    }
+
+    // Marks the steps of the equations equation i depends on at the same timestep (looking through equations without step)
+    void mark_steps(size_t i, std::vector<bool>& marked) const {
+        for (const auto& dependency : equations[i].dependencies) {
+            if (dependency.lag == 0) {
+                const size_t j = index(dependency.equation);
+                if (equations[j].step == no_step) {
+                    mark_steps(j, marked);
+                } else {
+                    marked[equations[j].step] = true;
+                }
+            }
+        }
+    }
+
+  public:
+    size_t add_step(const std::string& name, Time first, std::function<void(Time)> run) {
+        steps.push_back({name, first, run});
+        return steps.size() - 1;
+    }
+
+    void add(const std::string& name, size_t step, std::vector<Dependency<Time>> dependencies) {
+        if (!indices.emplace(name, equations.size()).second) {
+            throw std::runtime_error("equation '" + name + "' added twice");
+        }
+        equations.push_back({name, step, std::move(dependencies)});
+    }
+
+    void add_input(const std::string& name) {
+        add(name, no_step, {});
+    }
+
+    // Steps in the order to run them for each timestep (steps not depending on each other keep the order they were added in)
+    std::vector<Step> schedule() const {
+        levels();  // Checks for unknown equations and equation loops
+        std::vector<std::vector<bool>> depends(steps.size(), std::vector<bool>(steps.size(), false));
+        for (size_t i = 0; i < equations.size(); ++i) {
+            if (equations[i].step != no_step) {
+                mark_steps(i, depends[equations[i].step]);
+            }
+        }
+        std::vector<Step> res;
+        std::vector<bool> scheduled(steps.size(), false);
+        while (res.size() < steps.size()) {
+            size_t next = 0;
+            for (; next < steps.size(); ++next) {
+                if (!scheduled[next]) {
+                    bool ready = true;
+                    for (size_t j = 0; j < steps.size(); ++j) {
+                        if (j != next && depends[next][j] && !scheduled[j]) {
+                            ready = false;
+                            break;
+                        }
+                    }
+                    if (ready) {
+                        break;
+                    }
+                }
+            }
+            if (next == steps.size()) {
+                throw std::runtime_error("steps of equations depend on each other");
+            }
+            scheduled[next] = true;
+            res.push_back(steps[next]);
+        }
+        return res;
+    }
+
+    // Writes the graph in Graphviz format: equations grouped by step and labeled with their level (equations of the same level do not depend on
+    // each other at the same timestep, e.g. those of different regions), dependencies on earlier timesteps dashed, and the longest chain of
+    // dependencies within a timestep (the critical path) in bold
+    void dump(std::ostream& out) const {
+        const std::vector<size_t> levels = this->levels();
+        std::vector<size_t> critical_path;
+        if (!equations.empty()) {
+            size_t i = std::max_element(std::begin(levels), std::end(levels)) - std::begin(levels);
+            critical_path.push_back(i);
+            while (levels[i] > 0) {
+                for (const auto& dependency : equations[i].dependencies) {
+                    const size_t j = index(dependency.equation);
+                    if (dependency.lag == 0 && levels[j] + 1 == levels[i]) {
+                        i = j;
+                        break;
+                    }
+                }
+                critical_path.push_back(i);
+            }
+        }
+        const auto on_critical_path = [&](size_t i) { return std::find(std::begin(critical_path), std::end(critical_path), i) != std::end(critical_path); };
+
+        out << "digraph equations {\n";
+        out << "    // Schedule:";
+        for (const auto& step : schedule()) {
+            out << " " << step.name;
+        }
+        out << "\n";
+        for (size_t s = 0; s <= steps.size(); ++s) {
+            const std::string indent = s < steps.size() ? "        " : "    ";
+            if (s < steps.size()) {
+                out << "    subgraph \"cluster_" << steps[s].name << "\" {\n";
+                out << "        label=\"" << steps[s].name << "\";\n";
+            }
+            for (size_t i = 0; i < equations.size(); ++i) {
+                if (equations[i].step == (s < steps.size() ? s : no_step)) {
+                    out << indent << "\"" << equations[i].name << "\" [label=\"" << equations[i].name << "\\n" << levels[i] << "\"";
+                    if (on_critical_path(i)) {
+                        out << ", style=bold";
+                    }
+                    out << "];\n";
+                }
+            }
+            if (s < steps.size()) {
+                out << "    }\n";
+            }
+        }
+        for (size_t i = 0; i < equations.size(); ++i) {
+            for (const auto& dependency : equations[i].dependencies) {
+                out << "    \"" << dependency.equation << "\" -> \"" << equations[i].name << "\"";
+                if (dependency.lag > 0) {
+                    out << " [label=\"t-" << dependency.lag << "\", style=dashed]";
+                } else if (on_critical_path(i) && on_critical_path(index(dependency.equation))
+                           && levels[index(dependency.equation)] + 1 == levels[i]) {
+                    out << " [style=bold]";
+                }
+                out << ";\n";
+            }
+        }
+        out << "}\n";
+    }
+};
+}
+
+#endif
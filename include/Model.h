@@ -0,0 +1,598 @@
+/*
+  Copyright (C) 2017 Sven Willner <sven.willner@gmail.com>
+
+  This file is part of DICE++.
+
+  DICE++ is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of
+  the License, or (at your option) any later version.
+
+  DICE++ is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License
+  along with DICE++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "Climate.h"
+#include "Control.h"
+#include "DICEClimate.h"
+#include "DICEDamage.h"
+#include "Damage.h"
+#include "Economy.h"
+#include "Emissions.h"
+#include "EquationGraph.h"
+#include "Global.h"
+#include "Modules.h"
+#include "settingsnode.h"
+#include "types.h"
+
+namespace dice {
+
+// Interface to a model instance independent of the value type used for differentiation
+template<typename Constant, typename Time>
+class ModelBase {
+  public:
+    virtual ~ModelBase(){};
+    virtual void initialize() = 0;
+    virtual void reset() = 0;
+    // Independent initialized instance of the same type with the same control variables, sharing the tables precomputed from the parameters (reads
+    // the settings, hence not to be called while these are read elsewhere)
+    virtual std::unique_ptr<ModelBase> clone() = 0;
+    virtual std::vector<Constant>& mu() = 0;
+    virtual std::vector<Constant>& s() = 0;
+    // Both write the first grad_num derivatives to grad (if given)
+    virtual Constant utility(Constant* grad, size_t grad_num) = 0;
+    virtual Constant cca_constraint(Constant* grad, size_t grad_num) = 0;
+    // Both at the same variables (gradients written if given), in one pass where the model allows
+    virtual std::pair<Constant, Constant> utility_and_cca_constraint(Constant* utility_grad, Constant* constraint_grad, size_t grad_num) {
+        const Constant utility = this->utility(utility_grad, grad_num);
+        return {utility, cca_constraint(constraint_grad, grad_num)};
+    }
+    // Both write the derivatives along directions_num directions (given one after the other, each of length num) to out, only provided by
+    // DirectionalModel
+    virtual Constant utility_jacobian_vector(const Constant* /* directions */, size_t /* directions_num */, Constant* /* out */, size_t /* num */) {
+        throw std::runtime_error("model does not provide directional derivatives");
+    }
+    virtual Constant cca_constraint_jacobian_vector(const Constant* /* directions */, size_t /* directions_num */, Constant* /* out */, size_t /* num */) {
+        throw std::runtime_error("model does not provide directional derivatives");
+    }
+    // Both write the Hessian multiplied by direction to out (each of length num), only provided by SecondOrderModel
+    virtual Constant utility_hessian_vector(const Constant* /* direction */, Constant* /* out */, size_t /* num */) {
+        throw std::runtime_error("model does not provide second-order derivatives");
+    }
+    virtual Constant cca_constraint_hessian_vector(const Constant* /* direction */, Constant* /* out */, size_t /* num */) {
+        throw std::runtime_error("model does not provide second-order derivatives");
+    }
+};
+
+// Values of a model up to timestep t together with the control variables they depend on
+template<typename Value, typename Time, typename Constant>
+struct Snapshot {
+    Time t;
+    std::vector<Constant> mu;
+    std::vector<Constant> s;
+    std::vector<Value> states;     // Rows of the state block
+    std::vector<Value> utilities;  // Utilities of the eager evaluation
+};
+
+template<typename Value,
+         typename Time,
+         typename Constant = Value,
+         typename Variable = TimeSeries<Value>,
+         template<typename, typename, typename, typename> class Modules = DynamicModules>
+class Model : public ModelBase<Constant, Time> {
+  protected:
+    using Composition = Modules<Value, Time, Constant, Variable>;
+    const settings::SettingsNode& settings;
+    const Global<Constant, Time>& global;
+    bool eager = true;
+    Time evaluated_num = 0;         // Number of timesteps evaluated eagerly and still valid
+    std::vector<Value> utilities;  // Utility of the first economy at each timestep evaluated eagerly
+    EquationGraph<Time> graph;
+    std::vector<typename EquationGraph<Time>::Step> schedule;  // Steps of the eager evaluation in the order to run them for each timestep
+
+    template<typename V>
+    static inline Constant value(const V& v) {
+        return static_cast<Constant>(v.value());
+    }
+    static inline Constant value(const Constant& v) {
+        return v;
+    }
+
+    template<typename V>
+    static inline void copy_derivative(const V& v, Constant* grad, size_t grad_num) {
+        const auto& derivative = v.derivative();
+        for (size_t i = 0; i < grad_num; ++i) {
+            grad[i] = static_cast<Constant>(derivative[i]);
+        }
+    }
+    static inline void copy_derivative(const Constant& /* v */, Constant* /* grad */, size_t /* grad_num */) {
+        throw std::runtime_error("model does not provide derivatives");
+    }
+
+    template<typename M, typename... Args>
+    std::unique_ptr<ModelBase<Constant, Time>> clone_as(M& prototype, Args... args) {
+        std::unique_ptr<M> res(new M(settings, global, args...));
+        res->mu() = prototype.mu();
+        res->s() = prototype.s();
+        res->initialize(&prototype);
+        return std::unique_ptr<ModelBase<Constant, Time>>(res.release());
+    }
+
+  public:
+    Control<Value, Time, Constant, Variable> control;
+    StateBlock<Value, Time> state_block;  // Values of all stepwise series of the modules
+    std::vector<typename Composition::Economy> economies;
+    std::unique_ptr<typename Composition::Climate> climate;
+    std::unique_ptr<typename Composition::Damage> damage;
+    typename Composition::Emissions emissions;
+
+    Model(const settings::SettingsNode& settings_p, const Global<Constant, Time>& global_p)
+        : settings(settings_p),
+          global(global_p),
+          control(global_p.timestep_num, settings_p.has("optimization") && settings_p["optimization"]["optimize_mu"].as<bool>(false)),
+          emissions(global_p, control, state_block, economies){};
+
+    void initialize() override {
+        initialize(nullptr);
+    }
+
+    // Shares the tables of the modules with prototype if given (an initialized model with the same settings)
+    void initialize(const Model* prototype) {
+        {
+            const std::string evaluation = settings["evaluation"].as<std::string>("eager");
+            if (evaluation == "lazy") {
+                eager = false;
+            } else if (evaluation != "eager") {
+                throw std::runtime_error("unknown evaluation '" + evaluation + "'");
+            }
+        }
+
+        // Initialize climate module
+        {
+            const settings::SettingsNode& climate_node = settings["climate"];
+            climate.reset(
+                Composition::create_climate(climate_node["type"].as<std::string>(), climate_node["parameters"], global, control, state_block, emissions));
+            climate->initialize(prototype ? prototype->climate.get() : nullptr);
+        }
+
+        // Initialize damage module
+        {
+            const settings::SettingsNode& damage_node = settings["damage"];
+            damage.reset(Composition::create_damage(damage_node["type"].as<std::string>(), damage_node["parameters"], global, *climate));
+            damage->initialize();
+        }
+
+        // Initialize regions
+        {
+            for (const auto&& region_node : settings["regions"].as_sequence()) {
+                economies.emplace_back(typename Composition::Economy(region_node["economy"], global, control, state_block, *climate, *damage));
+                economies.back().initialize(prototype ? &prototype->economies[economies.size() - 1] : nullptr);
+            }
+        }
+
+        state_block.allocate(global.timestep_num);
+        utilities.assign(global.timestep_num, control.constant(0));
+
+        // Collect equations and schedule the eager evaluation
+        {
+            std::vector<std::string> regions;
+            for (size_t i = 0; i < economies.size(); ++i) {
+                regions.push_back("region" + std::to_string(i));
+            }
+            graph.add_input("mu");
+            graph.add_input("s");
+            for (size_t i = 0; i < economies.size(); ++i) {
+                economies[i].collect_equations(graph, regions[i]);
+            }
+            climate->collect_equations(graph);
+            damage->collect_equations(graph);
+            emissions.collect_equations(graph, regions);
+            const size_t objective = graph.add_step("objective", 0, [this](Time t) { utilities[t] = economies[0].evaluated(t).utility; });
+            graph.add("utility", objective, {{regions[0] + "/utility", 0}});
+            schedule = graph.schedule();
+        }
+
+        emissions.initialize();
+    }
+
+    // Only recalculates values from the earliest timestep whose control variables changed (values at t only depend on variables up to t)
+    void reset() override {
+        const Time t = control.changed_from();
+        if (t == 0) {
+            reset_all();
+        } else {
+            if (t < global.timestep_num) {
+                evaluated_num = std::min(evaluated_num, t);
+                climate->invalidate_after(t - 1);
+                damage->invalidate_after(t - 1);
+                for (auto&& economy : economies) {
+                    economy.invalidate_after(t - 1);
+                }
+                emissions.invalidate_after(t - 1);
+            }
+            control.reset();
+        }
+    }
+
+    void reset_all() {
+        evaluated_num = 0;
+        climate->reset();
+        damage->reset();
+        for (auto&& economy : economies) {
+            economy.reset();
+        }
+        emissions.reset();
+        // Rewinds derivative storage, hence only after all values have been dropped
+        control.reset();
+        emissions.initialize();
+    }
+
+    std::unique_ptr<ModelBase<Constant, Time>> clone() override {
+        return clone_as(*this);
+    }
+
+    std::vector<Constant>& mu() override {
+        return control.mu.value();
+    }
+
+    std::vector<Constant>& s() override {
+        return control.s.value();
+    }
+
+    // Evaluates all modules eagerly one timestep at a time, running the steps in the order scheduled from the equation graph and writing each
+    // value once into the state block, so that the (lazy) accessors only read stored values afterwards. Starts from the first timestep not
+    // evaluated since the last reset; steps not advancing states are run again for the timestep before, as the next timestep depends on them.
+    void evaluate() {
+        Time t = evaluated_num;
+        if (t == global.timestep_num) {
+            return;
+        }
+        if (t > 0) {
+            for (const auto& step : schedule) {
+                if (step.first == 0) {
+                    step.run(t - 1);
+                }
+            }
+        }
+        for (; t < global.timestep_num; ++t) {
+            for (const auto& step : schedule) {
+                if (t >= step.first) {
+                    step.run(t);
+                }
+            }
+        }
+        evaluated_num = global.timestep_num;
+    }
+
+    // Snapshots are immutable and hence shared by copies (e.g. by the branches of a scenario tree). Only for models whose values stay valid when
+    // calculating anew (i.e. not for reverse mode, where they refer to a tape which is rewound). Forward-mode derivatives belong to the arena of
+    // the thread taking the snapshot, which hence has to be the one using and releasing it.
+    std::shared_ptr<const Snapshot<Value, Time, Constant>> snapshot(Time t) {
+        if (t >= global.timestep_num) {
+            throw std::runtime_error("snapshot timestep out of range");
+        }
+        evaluate();
+        std::shared_ptr<Snapshot<Value, Time, Constant>> res(new Snapshot<Value, Time, Constant>{
+            t, {std::begin(control.mu.value()), std::begin(control.mu.value()) + t + 1},
+            {std::begin(control.s.value()), std::begin(control.s.value()) + t + 1}, state_block.rows(t),
+            {std::begin(utilities), std::begin(utilities) + t + 1}});
+        return res;
+    }
+
+    // Continues from a snapshot: the control variables up to its timestep are set to those of the snapshot, the later ones are kept (and can be
+    // changed before the next evaluation, which only calculates the values after the snapshot)
+    void restore(const Snapshot<Value, Time, Constant>& snapshot) {
+        const Time t = snapshot.t;
+        std::copy(std::begin(snapshot.mu), std::end(snapshot.mu), std::begin(control.mu.value()));
+        std::copy(std::begin(snapshot.s), std::end(snapshot.s), std::begin(control.s.value()));
+        state_block.assign_rows(snapshot.states);
+        std::copy(std::begin(snapshot.utilities), std::end(snapshot.utilities), std::begin(utilities));
+        climate->validate_until(t);
+        for (auto&& economy : economies) {
+            economy.validate_until(t);
+        }
+        emissions.validate_until(t);
+        evaluated_num = t + 1;
+        control.reset();
+    }
+
+    const EquationGraph<Time>& equations() const {
+        return graph;
+    }
+
+    Value calc_single_utility() {
+        Value utility = control.constant(0);
+        if (eager) {
+            evaluate();
+            for (Time t = 0; t < global.timestep_num; ++t) {
+                utility += utilities[t];
+            }
+        } else {
+            for (Time t = 0; t < global.timestep_num; ++t) {
+                utility += economies[0].utility(t);
+            }
+        }
+        return global.scale1 * utility + global.scale2;
+    }
+
+    Constant utility(Constant* grad, size_t grad_num) override {
+        const Value utility = calc_single_utility();
+        if (grad) {
+            copy_derivative(utility, grad, grad_num);
+        }
+        return value(utility);
+    }
+
+    Constant cca_constraint(Constant* grad, size_t grad_num) override {
+        if (eager) {
+            evaluate();
+        }
+        const Value c = economies[0].cca(global.timestep_num - 1) - global.fosslim;
+        if (grad) {
+            copy_derivative(c, grad, grad_num);
+        }
+        return value(c);
+    }
+
+    // States of all stepwise series, from which the calculation can be restarted at any timestep
+    std::vector<State<Value, Time>> states() {
+        std::vector<State<Value, Time>> res;
+        for (auto&& economy : economies) {
+            economy.collect_states(res);
+        }
+        climate->collect_states(res);
+        emissions.collect_states(res);
+        return res;
+    }
+
+    bool observe(Observer<Value, Time, Constant>& observer) {
+        return economies[0].observe(observer) && climate->observe(observer) && damage->observe(observer) && control.observe(observer)
+               && emissions.observe(observer);
+    }
+};
+
+// Reverse-mode model only recording single timesteps on the tape: a model without derivatives calculates the states at all timesteps once (as
+// plain values), then the reverse sweep runs backwards over the timesteps, recording each from its stored state. The tape hence only holds one
+// timestep, while the stored states take one value per series and timestep. The adjoints of the states at the end of a timestep are taken over by
+// the state variables at its beginning (on the tape after the control variables).
+template<typename Value, typename Time, typename Constant, typename Variable, template<typename, typename, typename, typename> class Modules = DynamicModules>
+class CheckpointedModel : public Model<Value, Time, Constant, Variable, Modules> {
+  protected:
+    Model<Constant, Time, Constant, PlainVariable<Constant>, Modules> passive;
+    std::vector<State<Value, Time>> recorded_states;
+    std::vector<State<Constant, Time>> passive_states;
+
+    std::vector<Constant> passive_state(Time t) {
+        std::vector<Constant> res(passive_states.size());
+        for (size_t j = 0; j < passive_states.size(); ++j) {
+            res[j] = passive_states[j].get(t);
+        }
+        return res;
+    }
+
+    // Function of the model differentiated by a checkpointed pass: the sum of running(t) over all timesteps and terminal() (at the last one), its
+    // value and gradient being accumulated in value and grad, and adjoints being those of the states at the timestep reversed last
+    struct Objective {
+        std::function<Value(Time)> running;
+        std::function<Value()> terminal;
+        Constant* grad;
+        Constant value;
+        std::vector<Constant> adjoints;
+    };
+
+    // Records timestep t starting from state, then adds for each objective the derivatives of running(t) (and of the terminal value for the last
+    // timestep) and of the states at t + 1 weighted by their adjoints to its gradient, and sets its adjoints to those of state
+    void record(Time t, const std::vector<Constant>& state, std::vector<Objective>& objectives, size_t grad_num) {
+        const size_t variables_num = this->control.variables_num;
+        const size_t n = variables_num + recorded_states.size();
+        Variable::rewind(n);
+        for (size_t j = 0; j < recorded_states.size(); ++j) {
+            recorded_states[j].restore(t, Value(variables_num + j, n, state[j]));
+        }
+        for (auto&& objective : objectives) {
+            Value v = objective.running(t);
+            if (t + 2 == this->global.timestep_num) {
+                v += objective.running(t + 1) + objective.terminal();
+            }
+            objective.value += this->value(v);
+            for (size_t j = 0; j < recorded_states.size(); ++j) {
+                if (objective.adjoints[j] != 0) {
+                    v += objective.adjoints[j] * recorded_states[j].get(t + 1);
+                }
+            }
+            const auto& derivative = v.derivative();
+            for (size_t i = 0; i < grad_num; ++i) {
+                objective.grad[i] += static_cast<Constant>(derivative[i]);
+            }
+            for (size_t j = 0; j < recorded_states.size(); ++j) {
+                objective.adjoints[j] = static_cast<Constant>(derivative[variables_num + j]);
+            }
+        }
+    }
+
+    // All objectives share the recording of each timestep. The states at the first timestep depend on the control variables as well (the
+    // emissions on mu at 0), their adjoints are carried over to the control variables by recording their calculation last.
+    void checkpointed(std::vector<Objective>& objectives, size_t grad_num) {
+        // Recording overwrites the states of an eager evaluation
+        this->evaluated_num = 0;
+        passive.mu() = this->mu();
+        passive.s() = this->s();
+        // Restoring states leaves earlier values of other evaluations behind
+        passive.reset_all();
+        for (auto&& objective : objectives) {
+            objective.value = 0;
+            objective.adjoints.assign(passive_states.size(), 0);
+            std::fill(objective.grad, objective.grad + grad_num, 0);
+        }
+        for (Time t = this->global.timestep_num - 1; t-- > 0;) {
+            record(t, passive_state(t), objectives, grad_num);
+        }
+        // The recorded states refer to the tape rewound below
+        const std::vector<Constant> state = passive_state(0);
+        for (size_t j = 0; j < recorded_states.size(); ++j) {
+            recorded_states[j].restore(0, this->control.constant(state[j]));
+        }
+        this->reset_all();
+        for (auto&& objective : objectives) {
+            Value v = this->control.constant(0);
+            for (size_t j = 0; j < recorded_states.size(); ++j) {
+                if (objective.adjoints[j] != 0) {
+                    v += objective.adjoints[j] * recorded_states[j].get(0);
+                }
+            }
+            const auto& derivative = v.derivative();
+            for (size_t i = 0; i < grad_num; ++i) {
+                objective.grad[i] += static_cast<Constant>(derivative[i]);
+            }
+        }
+    }
+
+    Objective utility_objective(Constant* grad) {
+        return {[this](Time t) -> Value { return this->global.scale1 * this->economies[0].utility(t); },
+                [this]() { return this->control.constant(this->global.scale2); }, grad, 0, {}};
+    }
+
+    Objective cca_constraint_objective(Constant* grad) {
+        return {[this](Time /* t */) { return this->control.constant(0); },
+                [this]() -> Value { return this->economies[0].cca(this->global.timestep_num - 1) - this->global.fosslim; }, grad, 0, {}};
+    }
+
+  public:
+    CheckpointedModel(const settings::SettingsNode& settings_p, const Global<Constant, Time>& global_p)
+        : Model<Value, Time, Constant, Variable, Modules>(settings_p, global_p), passive(settings_p, global_p){};
+
+    void initialize() override {
+        initialize(nullptr);
+    }
+
+    void initialize(const CheckpointedModel* prototype) {
+        Model<Value, Time, Constant, Variable, Modules>::initialize(prototype);
+        passive.initialize(prototype ? &prototype->passive : nullptr);
+        recorded_states = this->states();
+        passive_states = passive.states();
+    }
+
+    std::unique_ptr<ModelBase<Constant, Time>> clone() override {
+        return this->clone_as(*this);
+    }
+
+    Constant utility(Constant* grad, size_t grad_num) override {
+        if (!grad || this->global.timestep_num < 2) {
+            return Model<Value, Time, Constant, Variable, Modules>::utility(grad, grad_num);
+        }
+        std::vector<Objective> objectives{utility_objective(grad)};
+        checkpointed(objectives, grad_num);
+        return objectives[0].value;
+    }
+
+    Constant cca_constraint(Constant* grad, size_t grad_num) override {
+        if (!grad || this->global.timestep_num < 2) {
+            return Model<Value, Time, Constant, Variable, Modules>::cca_constraint(grad, grad_num);
+        }
+        std::vector<Objective> objectives{cca_constraint_objective(grad)};
+        checkpointed(objectives, grad_num);
+        return objectives[0].value;
+    }
+
+    std::pair<Constant, Constant> utility_and_cca_constraint(Constant* utility_grad, Constant* constraint_grad, size_t grad_num) override {
+        if (!utility_grad || !constraint_grad || this->global.timestep_num < 2) {
+            return Model<Value, Time, Constant, Variable, Modules>::utility_and_cca_constraint(utility_grad, constraint_grad, grad_num);
+        }
+        std::vector<Objective> objectives{utility_objective(utility_grad), cca_constraint_objective(constraint_grad)};
+        checkpointed(objectives, grad_num);
+        return {objectives[0].value, objectives[1].value};
+    }
+};
+
+// Model whose variables are seeded with given directions (as autodiff::SeededVariable), so that the derivatives of its values are the derivatives
+// along these directions
+template<typename Value, typename Time, typename Constant, typename Variable, template<typename, typename, typename, typename> class Modules = DynamicModules>
+class DirectionalModel : public Model<Value, Time, Constant, Variable, Modules> {
+  protected:
+    template<typename F>
+    Constant jacobian_vector(F f, const Constant* directions, size_t directions_num, Constant* out, size_t num) {
+        // Directions take the places of the variables in the derivative vectors
+        if (directions_num > this->control.variables_num) {
+            throw std::runtime_error("more directions than variables");
+        }
+        this->control.s.seed(directions, directions_num, num);
+        this->control.mu.seed(directions, directions_num, num);
+        this->reset();
+        const Value v = f();
+        const auto& derivative = v.derivative();
+        for (size_t j = 0; j < directions_num; ++j) {
+            out[j] = derivative[j];
+        }
+        return this->value(v);
+    }
+
+  public:
+    using Model<Value, Time, Constant, Variable, Modules>::Model;
+
+    std::unique_ptr<ModelBase<Constant, Time>> clone() override {
+        return this->clone_as(*this);
+    }
+
+    Constant utility_jacobian_vector(const Constant* directions, size_t directions_num, Constant* out, size_t num) override {
+        return jacobian_vector([this]() { return this->calc_single_utility(); }, directions, directions_num, out, num);
+    }
+
+    Constant cca_constraint_jacobian_vector(const Constant* directions, size_t directions_num, Constant* out, size_t num) override {
+        return jacobian_vector([this]() -> Value { return this->economies[0].cca(this->global.timestep_num - 1) - this->global.fosslim; }, directions,
+                               directions_num, out, num);
+    }
+};
+
+// Model whose values carry the tangent along a direction seeded by its variables (as autodiff::reverse::Value<autodiff::reverse::Dual<Constant>>
+// with autodiff::reverse::DualVariable<Constant>), so that their derivatives yield Hessian-vector products
+template<typename Value, typename Time, typename Constant, typename Variable, template<typename, typename, typename, typename> class Modules = DynamicModules>
+class SecondOrderModel : public Model<Value, Time, Constant, Variable, Modules> {
+  protected:
+    template<typename F>
+    Constant hessian_vector(F f, const Constant* direction, Constant* out, size_t num) {
+        this->control.s.set_direction(direction, num);
+        this->control.mu.set_direction(direction, num);
+        // The direction enters every value depending on the variables, hence reset only now
+        this->reset();
+        const Value v = f();
+        const auto& derivative = v.derivative();
+        for (size_t i = 0; i < num; ++i) {
+            out[i] = derivative[i].tangent();
+        }
+        return this->value(v);
+    }
+
+  public:
+    using Model<Value, Time, Constant, Variable, Modules>::Model;
+
+    std::unique_ptr<ModelBase<Constant, Time>> clone() override {
+        return this->clone_as(*this);
+    }
+
+    Constant utility_hessian_vector(const Constant* direction, Constant* out, size_t num) override {
+        return hessian_vector([this]() { return this->calc_single_utility(); }, direction, out, num);
+    }
+
+    Constant cca_constraint_hessian_vector(const Constant* direction, Constant* out, size_t num) override {
+        return hessian_vector([this]() -> Value { return this->economies[0].cca(this->global.timestep_num - 1) - this->global.fosslim; }, direction, out,
+                              num);
+    }
+};
+}
+
+#endif
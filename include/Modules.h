@@ -0,0 +1,112 @@
+/*
+  Copyright (C) 2017 Sven Willner <sven.willner@gmail.com>
+
+  This file is part of DICE++.
+
+  DICE++ is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of
+  the License, or (at your option) any later version.
+
+  DICE++ is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License
+  along with DICE++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef MODULES_H
+#define MODULES_H
+
+#include <stdexcept>
+#include <string>
+#include "types.h"
+
+namespace dice {
+
+template<typename Constant, typename Time>
+class Global;
+template<typename Value, typename Time, typename Constant, typename Variable>
+class Control;
+template<typename Value, typename Time, typename Constant, typename Variable, typename Modules>
+class Economy;
+template<typename Value, typename Time, typename Constant, typename Variable, typename Modules>
+class Emissions;
+
+namespace climate {
+template<typename Value, typename Time, typename Constant, typename Variable, typename Modules>
+class Climate;
+template<typename Value, typename Time, typename Constant, typename Variable, typename Modules>
+class DICEClimate;
+}
+
+namespace damage {
+template<typename Value, typename Time, typename Constant, typename Variable, typename Modules>
+class Damage;
+template<typename Value, typename Time, typename Constant, typename Variable, typename Modules>
+class DICEDamage;
+}
+
+// Composition of the modules of a model: the types the modules refer to each other by and the creation of the climate and damage modules from
+// their `type` setting
+
+// Climate and damage modules of any type, called through their virtual interfaces
+template<typename Value, typename Time, typename Constant, typename Variable>
+struct DynamicModules {
+    using Economy = dice::Economy<Value, Time, Constant, Variable, DynamicModules>;
+    using Emissions = dice::Emissions<Value, Time, Constant, Variable, DynamicModules>;
+    using Climate = climate::Climate<Value, Time, Constant, Variable, DynamicModules>;
+    using Damage = damage::Damage<Value, Time, Constant, Variable, DynamicModules>;
+
+    static Climate* create_climate(const std::string& type,
+                                   const settings::SettingsNode& settings,
+                                   const Global<Constant, Time>& global,
+                                   const Control<Value, Time, Constant, Variable>& control,
+                                   StateBlock<Value, Time>& state_block,
+                                   Emissions& emissions) {
+        if (type == "dice") {
+            return new climate::DICEClimate<Value, Time, Constant, Variable, DynamicModules>(settings, global, control, state_block, emissions);
+        }
+        throw std::runtime_error("unknown climate module type '" + type + "'");
+    }
+
+    static Damage* create_damage(const std::string& type, const settings::SettingsNode& settings, const Global<Constant, Time>& global, Climate& climate) {
+        if (type == "dice") {
+            return new damage::DICEDamage<Value, Time, Constant, Variable, DynamicModules>(settings, global, climate);
+        }
+        throw std::runtime_error("unknown damage module type '" + type + "'");
+    }
+};
+
+// DICE climate and damage modules composed at compile time, so that the calls between the modules are resolved statically and can be inlined
+template<typename Value, typename Time, typename Constant, typename Variable>
+struct DICEModules {
+    using Economy = dice::Economy<Value, Time, Constant, Variable, DICEModules>;
+    using Emissions = dice::Emissions<Value, Time, Constant, Variable, DICEModules>;
+    using Climate = climate::DICEClimate<Value, Time, Constant, Variable, DICEModules>;
+    using Damage = damage::DICEDamage<Value, Time, Constant, Variable, DICEModules>;
+
+    static Climate* create_climate(const std::string& type,
+                                   const settings::SettingsNode& settings,
+                                   const Global<Constant, Time>& global,
+                                   const Control<Value, Time, Constant, Variable>& control,
+                                   StateBlock<Value, Time>& state_block,
+                                   Emissions& emissions) {
+        if (type != "dice") {
+            throw std::runtime_error("climate module type '" + type + "' not available in DICE composition");
+        }
+        return new Climate(settings, global, control, state_block, emissions);
+    }
+
+    static Damage* create_damage(const std::string& type, const settings::SettingsNode& settings, const Global<Constant, Time>& global, Climate& climate) {
+        if (type != "dice") {
+            throw std::runtime_error("damage module type '" + type + "' not available in DICE composition");
+        }
+        return new Damage(settings, global, climate);
+    }
+};
+}
+
+#endif
@@ -20,6 +20,8 @@
 #ifndef OPTIMIZATION_H
 #define OPTIMIZATION_H
 
+#include <memory>
+#include <stdexcept>
 #include <vector>
 #include "types.h"
 
@@ -30,17 +32,69 @@ class SettingsNode;
 namespace dice {
 template<typename Value, typename Time>
 class Optimization {
+  protected:
+    void project_gradient(const Value* grad, const Value* directions, size_t directions_num, Value* out) const;
+    void assemble_hessian(void (Optimization::*hessian_vector_p)(const Value*, const Value*, Value*), const Value* vars, Value* out);
+
   public:
     const size_t variables_num;
     const size_t objectives_num;
     const size_t constraints_num;
+    std::vector<Value> lower_bounds;  // of the variables, by default 0
+    std::vector<Value> upper_bounds;  // of the variables, by default 1
+    Value constraint_tolerance = 0.1;  // up to which constraint values count as satisfied
 
     Optimization(size_t variables_num_p, size_t objectives_num_p, size_t constraints_num_p)
-        : variables_num(variables_num_p), objectives_num(objectives_num_p), constraints_num(constraints_num_p){};
+        : variables_num(variables_num_p),
+          objectives_num(objectives_num_p),
+          constraints_num(constraints_num_p),
+          lower_bounds(variables_num_p, 0),
+          upper_bounds(variables_num_p, 1){};
     virtual ~Optimization(){};
+    // Writes the solution found back to initial_values
     void optimize(const settings::SettingsNode& settings, TimeSeries<Value>& initial_values, bool verbose);
+    // Local optimizations from each of the starts (solutions written back to them) on up to threads threads (using clones if has_clones(),
+    // otherwise sequentially); returns the index of the best feasible solution (the least infeasible one if none is feasible), which is also
+    // evaluated last
+    size_t multistart(const settings::SettingsNode& settings, std::vector<TimeSeries<Value>>& starts, size_t threads, bool verbose);
     virtual std::vector<Value> objective(const Value* vars, Value* grad) = 0;   // to be maximized
     virtual std::vector<Value> constraint(const Value* vars, Value* grad) = 0;  // to be <= 0
+    // Derivatives at vars along directions_num directions (given one after the other, each of length variables_num) written to out; by default
+    // projected from the gradient
+    virtual void jacobian_vector(const Value* vars, const Value* directions, size_t directions_num, Value* out) {
+        std::vector<Value> grad(variables_num);
+        objective(vars, &grad[0]);
+        project_gradient(&grad[0], directions, directions_num, out);
+    }
+    virtual void constraint_jacobian_vector(const Value* vars, const Value* directions, size_t directions_num, Value* out) {
+        std::vector<Value> grad(variables_num);
+        constraint(vars, &grad[0]);
+        project_gradient(&grad[0], directions, directions_num, out);
+    }
+    // Second-order derivatives, only available if has_hessians(): Hessian at vars multiplied by v (both of length variables_num) written to out
+    virtual bool has_hessians() const {
+        return false;
+    }
+    virtual void hessian_vector(const Value* /* vars */, const Value* /* v */, Value* /* out */) {
+        throw std::runtime_error("optimization does not provide Hessians");
+    }
+    virtual void constraint_hessian_vector(const Value* /* vars */, const Value* /* v */, Value* /* out */) {
+        throw std::runtime_error("optimization does not provide Hessians");
+    }
+    // Independent instance for evaluations from another thread at the same time, only available if has_clones()
+    virtual bool has_clones() const {
+        return false;
+    }
+    virtual std::unique_ptr<Optimization> clone() {
+        throw std::runtime_error("optimization cannot be cloned");
+    }
+    // Exact dense Hessians (variables_num x variables_num, row-major) from one Hessian-vector product per variable
+    void hessian(const Value* vars, Value* out) {
+        assemble_hessian(&Optimization::hessian_vector, vars, out);
+    }
+    void constraint_hessian(const Value* vars, Value* out) {
+        assemble_hessian(&Optimization::constraint_hessian_vector, vars, out);
+    }
 };
 }
 
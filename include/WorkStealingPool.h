@@ -0,0 +1,121 @@
+/*
+  Copyright (C) 2017 Sven Willner <sven.willner@gmail.com>
+
+  This file is part of DICE++.
+
+  DICE++ is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as
+  published by the Free Software Foundation, either version 3 of
+  the License, or (at your option) any later version.
+
+  DICE++ is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License
+  along with DICE++.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef WORKSTEALINGPOOL_H
+#define WORKSTEALINGPOOL_H
+
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace dice {
+
+// Runs a batch of tasks on a fixed number of workers, each with a queue of its own: a worker takes tasks from the front of its queue and, once
+// that is empty, steals from the back of the others' queues, so that long tasks (e.g. local optimizations of very different lengths) do not leave
+// workers idle. Tasks are told the index of the worker running them, e.g. to use resources owned by that worker
+class WorkStealingPool {
+  public:
+    using Task = std::function<void(size_t worker)>;
+
+  protected:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+    std::vector<Queue> queues;
+    size_t next_queue = 0;
+
+    bool take(size_t worker, Task& task) {
+        {
+            Queue& own = queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                task = std::move(own.tasks.front());
+                own.tasks.pop_front();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); ++i) {
+            Queue& other = queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(other.mutex);
+            if (!other.tasks.empty()) {
+                task = std::move(other.tasks.back());
+                other.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+  public:
+    explicit WorkStealingPool(size_t workers) : queues(workers) {
+        if (workers == 0) {
+            throw std::runtime_error("work-stealing pool needs at least one worker");
+        }
+    }
+
+    size_t size() const {
+        return queues.size();
+    }
+
+    // Distributes the tasks round-robin over the workers' queues (not thread-safe, to be called before run())
+    void add(Task task) {
+        queues[next_queue].tasks.push_back(std::move(task));
+        next_queue = (next_queue + 1) % queues.size();
+    }
+
+    // Runs all tasks added, the calling thread being worker 0, and returns when all are done; rethrows the first exception thrown by a task
+    // (the remaining tasks still being run)
+    void run() {
+        std::exception_ptr exception;
+        std::mutex exception_mutex;
+        auto work = [&](size_t worker) {
+            Task task;
+            while (take(worker, task)) {
+                try {
+                    task(worker);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(exception_mutex);
+                    if (!exception) {
+                        exception = std::current_exception();
+                    }
+                }
+            }
+        };
+        std::vector<std::thread> threads;
+        for (size_t worker = 1; worker < queues.size(); ++worker) {
+            threads.emplace_back(work, worker);
+        }
+        work(0);
+        for (auto&& thread : threads) {
+            thread.join();
+        }
+        next_queue = 0;
+        if (exception) {
+            std::rethrow_exception(exception);
+        }
+    }
+};
+}
+
+#endif
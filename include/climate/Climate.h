@@ -22,30 +22,49 @@
 
 #include "Control.h"
 #include "Emissions.h"
+#include "EquationGraph.h"
 #include "Global.h"
+#include "Modules.h"
 #include "types.h"
 
 namespace dice {
 namespace climate {
 
-template<typename Value, typename Time, typename Constant = Value, typename Variable = TimeSeries<Value>>
+template<typename Value,
+         typename Time,
+         typename Constant = Value,
+         typename Variable = TimeSeries<Value>,
+         typename Modules = DynamicModules<Value, Time, Constant, Variable>>
 class Climate {
   protected:
     const Global<Constant, Time>& global;
     const Control<Value, Time, Constant, Variable>& control;
-    Emissions<Value, Time, Constant, Variable>& E;
+    StateBlock<Value, Time>& state_block;
+    typename Modules::Emissions& E;
 
   public:
-    Climate(const Global<Constant, Time>& global_p, const Control<Value, Time, Constant, Variable>& control_p, Emissions<Value, Time, Constant, Variable>& E_p)
-        : global(global_p), control(control_p), E(E_p){};
+    Climate(const Global<Constant, Time>& global_p,
+            const Control<Value, Time, Constant, Variable>& control_p,
+            StateBlock<Value, Time>& state_block_p,
+            typename Modules::Emissions& E_p)
+        : global(global_p), control(control_p), state_block(state_block_p), E(E_p){};
     virtual ~Climate(){};
     virtual bool observe(Observer<Value, Time, Constant>& observer) {
         OBSERVE_VAR(T_atm);
         return true;
     }
-    virtual void initialize(){};
+    // Tables depending only on the parameters can be shared with prototype if given (an initialized instance of the same type and settings)
+    virtual void initialize(const Climate* /* prototype */){};
     virtual void reset(){};
-    virtual Value T_atm(Time t) = 0;
+    virtual void invalidate_after(Time /* t */){};
+    virtual void validate_until(Time /* t */){};
+    virtual const Value& T_atm(Time t) = 0;
+    // Eager evaluation (see Model::evaluate()): advances all series to t from their values and the emissions at t - 1
+    virtual void advance(Time t) = 0;
+    // Adds the equations of the module and the step running advance()
+    virtual void collect_equations(EquationGraph<Time>& graph) = 0;
+    // Adds the states of all stepwise series of the module
+    virtual void collect_states(std::vector<State<Value, Time>>& states) = 0;
 };
 }
 }
@@ -21,6 +21,7 @@
 #define DICECLIMATE_H
 
 #include <math.h>
+#include <memory>
 #include "Climate.h"
 #include "Emissions.h"
 #include "settingsnode.h"
@@ -28,12 +29,17 @@
 namespace dice {
 namespace climate {
 
-template<typename Value, typename Time, typename Constant = Value, typename Variable = TimeSeries<Value>>
-class DICEClimate : public Climate<Value, Time, Constant, Variable> {
+template<typename Value,
+         typename Time,
+         typename Constant = Value,
+         typename Variable = TimeSeries<Value>,
+         typename Modules = DynamicModules<Value, Time, Constant, Variable>>
+class DICEClimate final : public Climate<Value, Time, Constant, Variable, Modules> {
   protected:
-    using Climate<Value, Time, Constant, Variable>::global;
-    using Climate<Value, Time, Constant, Variable>::control;
-    using Climate<Value, Time, Constant, Variable>::E;  // Total CO2 emissions (GtCO2 per year)
+    using Climate<Value, Time, Constant, Variable, Modules>::global;
+    using Climate<Value, Time, Constant, Variable, Modules>::control;
+    using Climate<Value, Time, Constant, Variable, Modules>::state_block;
+    using Climate<Value, Time, Constant, Variable, Modules>::E;  // Total CO2 emissions (GtCO2 per year)
     const settings::SettingsNode& settings;
 
     const Constant b12{settings["b12"].template as<Constant>()};            // Carbon cycle transition matrix
@@ -48,7 +54,7 @@ class DICEClimate : public Climate<Value, Time, Constant, Variable> {
     const Constant M_l_eq{settings["M_l_eq"].template as<Constant>()};      // Equilibrium concentration in lower strata (GtC)
     const Constant M_u_eq{settings["M_u_eq"].template as<Constant>()};      // Equilibrium concentration in upper strata (GtC)
     const Constant t2xco2{settings["t2xco2"].template as<Constant>()};      // Equilibrium temp impact (oC per doubling CO2)
-    const Value T_atm_upper{control.variables_num, settings["T_atm_upper"].template as<Constant>()};
+    const Value T_atm_upper = control.constant(settings["T_atm_upper"].template as<Constant>());
 
     // Carbon cycle transition matrix
     Constant b11 = 1 - b12;
@@ -57,86 +63,81 @@ class DICEClimate : public Climate<Value, Time, Constant, Variable> {
     Constant b32 = b23 * M_u_eq / M_l_eq;
     Constant b33 = 1 - b32;
 
-    StepwiseBackwardLookingTimeSeries<LowerBounded<Value>, Time> M_atm_series{
-        global.timestep_num,
-        {{control.variables_num, settings["M_atm0"].template as<Constant>()}, {control.variables_num, settings["M_atm_lower"].template as<Constant>()}}};
-    StepwiseBackwardLookingTimeSeries<LowerBounded<Value>, Time> M_l_series{
-        global.timestep_num,
-        {{control.variables_num, settings["M_l0"].template as<Constant>()}, {control.variables_num, settings["M_l_lower"].template as<Constant>()}}};
-    StepwiseBackwardLookingTimeSeries<LowerBounded<Value>, Time> M_u_series{
-        global.timestep_num,
-        {{control.variables_num, settings["M_u0"].template as<Constant>()}, {control.variables_num, settings["M_u_lower"].template as<Constant>()}}};
-    StepwiseBackwardLookingTimeSeries<Bounded<Value>, Time> T_ocean_series{global.timestep_num,
-                                                                           {{control.variables_num, settings["T_ocean0"].template as<Constant>()},
-                                                                            {control.variables_num, settings["T_ocean_lower"].template as<Constant>()},
-                                                                            {control.variables_num, settings["T_ocean_upper"].template as<Constant>()}}};
-    StepwiseBackwardLookingTimeSeries<Value, Time> T_atm_series{global.timestep_num, {control.variables_num, settings["T_atm0"].template as<Constant>()}};
+    std::shared_ptr<const TimeSeries<Constant>> forcoth_table;  // Calculated once by initialize()
+
+    StateSeries<Value, Time, LowerBounded<Value, Constant>> M_atm_series{
+        state_block, control.constant(settings["M_atm0"].template as<Constant>()), control.constant(settings["M_atm_lower"].template as<Constant>())};
+    StateSeries<Value, Time, LowerBounded<Value, Constant>> M_l_series{
+        state_block, control.constant(settings["M_l0"].template as<Constant>()), control.constant(settings["M_l_lower"].template as<Constant>())};
+    StateSeries<Value, Time, LowerBounded<Value, Constant>> M_u_series{
+        state_block, control.constant(settings["M_u0"].template as<Constant>()), control.constant(settings["M_u_lower"].template as<Constant>())};
+    StateSeries<Value, Time, Bounded<Value, Constant>> T_ocean_series{state_block,
+                                                                      control.constant(settings["T_ocean0"].template as<Constant>()),
+                                                                      {control.constant(settings["T_ocean_lower"].template as<Constant>()),
+                                                                       control.constant(settings["T_ocean_upper"].template as<Constant>())}};
+    StateSeries<Value, Time> T_atm_series{state_block, control.constant(settings["T_atm0"].template as<Constant>())};
+
+    // The equations at timestep t given the values they depend on, used by both the lazy accessors below and the eager evaluation (advance())
+    Value M_atm_equation(const Value& M_atm_last, const Value& M_u_last, const Value& E_last) const {
+        return M_atm_last * b11 + M_u_last * b21 + E_last * global.timestep_length / 3.666;
+    }
+    Value M_l_equation(const Value& M_l_last, const Value& M_u_last) const {
+        return M_l_last * b33 + M_u_last * b23;
+    }
+    Value M_u_equation(const Value& M_atm_last, const Value& M_u_last, const Value& M_l_last) const {
+        return M_atm_last * b12 + M_u_last * b22 + M_l_last * b32;
+    }
+    Value T_ocean_equation(const Value& T_ocean_last, const Value& T_atm_last) const {
+        return T_ocean_last + c4 * (T_atm_last - T_ocean_last);
+    }
+    Value force_equation(Time t, const Value& M_atm_t) {
+        return fco22x * std::log2(M_atm_t / 588) + forcoth(t);  // TODO 588 == M_atm_eq ??
+    }
+    Value T_atm_equation(const Value& T_atm_last, const Value& force_t, const Value& T_ocean_last) const {
+        return std::min(T_atm_upper, T_atm_last + c1 * (force_t - (fco22x / t2xco2) * T_atm_last - c3 * (T_atm_last - T_ocean_last)));
+    }
 
   public:
     DICEClimate(const settings::SettingsNode& settings_p,
                 const Global<Constant, Time>& global_p,
                 const Control<Value, Time, Constant, Variable>& control_p,
-                Emissions<Value, Time, Constant, Variable>& E_p)
-        : Climate<Value, Time, Constant, Variable>(global_p, control_p, E_p), settings(settings_p){};
+                StateBlock<Value, Time>& state_block_p,
+                typename Modules::Emissions& E_p)
+        : Climate<Value, Time, Constant, Variable, Modules>(global_p, control_p, state_block_p, E_p), settings(settings_p){};
 
     // Concentration in atmosphere 2010 (GtC)
-    Value M_atm(Time t) {
-        return M_atm_series.get(t, [this](Time t, Value M_atm_last) {
-
-            return M_atm_last * b11 + M_u(t - 1) * b21 + E(t - 1) * global.timestep_length / 3.666;
-
-        });
+    const Value& M_atm(Time t) {
+        return M_atm_series.get(t, [this](Time t, const Value& M_atm_last) -> Value { return M_atm_equation(M_atm_last, M_u(t - 1), E(t - 1)); });
     }
 
     // Carbon concentration increase in lower oceans (GtC from 1750)
-    Value M_l(Time t) {
-        return M_l_series.get(t, [this](Time t, Value M_l_last) {
-
-            return M_l_last * b33 + M_u(t - 1) * b23;
-
-        });
+    const Value& M_l(Time t) {
+        return M_l_series.get(t, [this](Time t, const Value& M_l_last) -> Value { return M_l_equation(M_l_last, M_u(t - 1)); });
     }
 
     // Carbon concentration increase in shallow oceans (GtC from 1750)
-    Value M_u(Time t) {
-        return M_u_series.get(t, [this](Time t, Value M_u_last) {
-
-            return M_atm(t - 1) * b12 + M_u_last * b22 + M_l(t - 1) * b32;
-
-        });
+    const Value& M_u(Time t) {
+        return M_u_series.get(t, [this](Time t, const Value& M_u_last) -> Value { return M_u_equation(M_atm(t - 1), M_u_last, M_l(t - 1)); });
     }
 
     // Increase in temperature of lower oceans (degrees C from 1900)
-    Value T_ocean(Time t) {
-        return T_ocean_series.get(t, [this](Time t, Value T_ocean_last) {
-
-            return T_ocean_last + c4 * (T_atm(t - 1) - T_ocean_last);
-
-        });
+    const Value& T_ocean(Time t) {
+        return T_ocean_series.get(t, [this](Time t, const Value& T_ocean_last) -> Value { return T_ocean_equation(T_ocean_last, T_atm(t - 1)); });
     }
 
     // Exogenous forcing for other greenhouse gases
     Constant forcoth(Time t) {
-        const Time year = global.start_year + global.timestep_length * t;
-        if (year > 2100) {
-            return fex1;
-        } else {
-            return fex0 + (fex1 - fex0) * (global.timestep_length * 0.2 * t) / 18;
-        }
+        return (*forcoth_table)[t];
     }
 
     // Increase in radiative forcing (watts per m2 from 1900)
     Value force(Time t) {
-        return fco22x * std::log2(M_atm(t) / 588) + forcoth(t);  // TODO 588 == M_atm_eq ??
+        return force_equation(t, M_atm(t));
     }
 
     // Increase temperature of atmosphere (degrees C from 1900)
-    Value T_atm(Time t) override {
-        return T_atm_series.get(t, [this](Time t, Value T_atm_last) {
-
-            return std::min(T_atm_upper, T_atm_last + c1 * (force(t) - (fco22x / t2xco2) * T_atm_last - c3 * (T_atm_last - T_ocean(t - 1))));
-
-        });
+    const Value& T_atm(Time t) override {
+        return T_atm_series.get(t, [this](Time t, const Value& T_atm_last) -> Value { return T_atm_equation(T_atm_last, force(t), T_ocean(t - 1)); });
     }
 
     bool observe(Observer<Value, Time, Constant>& observer) override {
@@ -151,6 +152,65 @@ class DICEClimate : public Climate<Value, Time, Constant, Variable> {
         return true;
     }
 
+    void initialize(const Climate<Value, Time, Constant, Variable, Modules>* prototype) override {
+        if (prototype) {
+            forcoth_table = static_cast<const DICEClimate*>(prototype)->forcoth_table;
+            return;
+        }
+        std::shared_ptr<TimeSeries<Constant>> res = std::make_shared<TimeSeries<Constant>>(global.timestep_num);
+        for (Time t = 0; t < global.timestep_num; ++t) {
+            const Time year = global.start_year + global.timestep_length * t;
+            if (year > 2100) {
+                (*res)[t] = fex1;
+            } else {
+                (*res)[t] = fex0 + (fex1 - fex0) * (global.timestep_length * 0.2 * t) / 18;
+            }
+        }
+        forcoth_table = res;
+    }
+
+    void advance(Time t) override {
+        M_atm_series.restore(t, M_atm_equation(M_atm_series[t - 1], M_u_series[t - 1], E(t - 1)));
+        M_l_series.restore(t, M_l_equation(M_l_series[t - 1], M_u_series[t - 1]));
+        M_u_series.restore(t, M_u_equation(M_atm_series[t - 1], M_u_series[t - 1], M_l_series[t - 1]));
+        T_ocean_series.restore(t, T_ocean_equation(T_ocean_series[t - 1], T_atm_series[t - 1]));
+        T_atm_series.restore(t, T_atm_equation(T_atm_series[t - 1], force(t), T_ocean_series[t - 1]));
+    }
+
+    void collect_equations(EquationGraph<Time>& graph) override {
+        const size_t step = graph.add_step("climate", 1, [this](Time t) { advance(t); });
+        graph.add("M_atm", step, {{"M_atm", 1}, {"M_u", 1}, {"E", 1}});
+        graph.add("M_l", step, {{"M_l", 1}, {"M_u", 1}});
+        graph.add("M_u", step, {{"M_atm", 1}, {"M_u", 1}, {"M_l", 1}});
+        graph.add("T_ocean", step, {{"T_ocean", 1}, {"T_atm", 1}});
+        graph.add("force", step, {{"M_atm", 0}});
+        graph.add("T_atm", step, {{"T_atm", 1}, {"force", 0}, {"T_ocean", 1}});
+    }
+
+    void invalidate_after(Time t) override {
+        M_atm_series.invalidate_after(t);
+        M_l_series.invalidate_after(t);
+        M_u_series.invalidate_after(t);
+        T_ocean_series.invalidate_after(t);
+        T_atm_series.invalidate_after(t);
+    }
+
+    void validate_until(Time t) override {
+        M_atm_series.validate_until(t);
+        M_l_series.validate_until(t);
+        M_u_series.validate_until(t);
+        T_ocean_series.validate_until(t);
+        T_atm_series.validate_until(t);
+    }
+
+    void collect_states(std::vector<State<Value, Time>>& states) override {
+        states.push_back({[this](Time t) { return M_atm(t); }, [this](Time t, const Value& v) { M_atm_series.restore(t, v); }});
+        states.push_back({[this](Time t) { return M_l(t); }, [this](Time t, const Value& v) { M_l_series.restore(t, v); }});
+        states.push_back({[this](Time t) { return M_u(t); }, [this](Time t, const Value& v) { M_u_series.restore(t, v); }});
+        states.push_back({[this](Time t) { return T_ocean(t); }, [this](Time t, const Value& v) { T_ocean_series.restore(t, v); }});
+        states.push_back({[this](Time t) { return T_atm(t); }, [this](Time t, const Value& v) { T_atm_series.restore(t, v); }});
+    }
+
     void reset() override {
         M_atm_series.reset();
         M_l_series.reset();
@@ -26,11 +26,15 @@
 namespace dice {
 namespace damage {
 
-template<typename Value, typename Time, typename Constant = Value, typename Variable = TimeSeries<Value>>
-class DICEDamage : public Damage<Value, Time, Constant, Variable> {
+template<typename Value,
+         typename Time,
+         typename Constant = Value,
+         typename Variable = TimeSeries<Value>,
+         typename Modules = DynamicModules<Value, Time, Constant, Variable>>
+class DICEDamage final : public Damage<Value, Time, Constant, Variable, Modules> {
   protected:
-    using Damage<Value, Time, Constant, Variable>::global;
-    using Damage<Value, Time, Constant, Variable>::climate;
+    using Damage<Value, Time, Constant, Variable, Modules>::global;
+    using Damage<Value, Time, Constant, Variable, Modules>::climate;
     const settings::SettingsNode& settings;
 
     const Constant a1{settings["a1"].template as<Constant>()};  // Damage intercept
@@ -38,11 +42,15 @@ class DICEDamage : public Damage<Value, Time, Constant, Variable> {
     const Constant a3{settings["a3"].template as<Constant>()};  // Damage exponent
 
   public:
-    DICEDamage(const settings::SettingsNode& settings_p, const Global<Constant, Time>& global_p, climate::Climate<Value, Time, Constant, Variable>& climate_p)
-        : Damage<Value, Time, Constant, Variable>(global_p, climate_p), settings(settings_p) {
+    DICEDamage(const settings::SettingsNode& settings_p, const Global<Constant, Time>& global_p, typename Modules::Climate& climate_p)
+        : Damage<Value, Time, Constant, Variable, Modules>(global_p, climate_p), settings(settings_p) {
     }
     Value damfrac(Time t) override {
-        return a1 * climate.T_atm(t) + a2 * std::pow(climate.T_atm(t), a3);
+        const Value& T_atm_t = climate.T_atm(t);
+        return a1 * T_atm_t + a2 * std::pow(T_atm_t, a3);
+    }
+    void collect_equations(EquationGraph<Time>& graph) override {
+        graph.add("damfrac", EquationGraph<Time>::no_step, {{"T_atm", 0}});
     }
 };
 }
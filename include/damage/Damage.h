@@ -20,29 +20,25 @@
 #ifndef DAMAGE_H
 #define DAMAGE_H
 
+#include "EquationGraph.h"
+#include "Modules.h"
 #include "types.h"
 
 namespace dice {
-
-template<typename Value, typename Time>
-class Global;
-
-namespace climate {
-
-template<typename Value, typename Time, typename Constant, typename Variable>
-class Climate;
-}
-
 namespace damage {
 
-template<typename Value, typename Time, typename Constant = Value, typename Variable = TimeSeries<Value>>
+template<typename Value,
+         typename Time,
+         typename Constant = Value,
+         typename Variable = TimeSeries<Value>,
+         typename Modules = DynamicModules<Value, Time, Constant, Variable>>
 class Damage {
   protected:
     const Global<Constant, Time>& global;
-    climate::Climate<Value, Time, Constant, Variable>& climate;
+    typename Modules::Climate& climate;
 
   public:
-    Damage(const Global<Constant, Time>& global_p, climate::Climate<Value, Time, Constant, Variable>& climate_p) : global(global_p), climate(climate_p){};
+    Damage(const Global<Constant, Time>& global_p, typename Modules::Climate& climate_p) : global(global_p), climate(climate_p){};
     virtual ~Damage(){};
     virtual bool observe(Observer<Value, Time, Constant>& observer) {
         OBSERVE_VAR(damfrac);
@@ -50,7 +46,10 @@ class Damage {
     }
     virtual void initialize(){};
     virtual void reset(){};
+    virtual void invalidate_after(Time /* t */){};
     virtual Value damfrac(Time t) = 0;  // Damages as fraction of gross output
+    // Adds the equations of the module (calculated on demand, i.e. without step)
+    virtual void collect_equations(EquationGraph<Time>& graph) = 0;
 };
 }
 }
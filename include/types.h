@@ -20,8 +20,11 @@
 #ifndef TYPES_H
 #define TYPES_H
 
+#include <algorithm>
 #include <functional>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 #include "settingsnode.h"
 
@@ -41,6 +44,11 @@ using TimeSeries = std::vector<Value>;
 
 template<typename Value, typename Time, typename Constant = Value>
 class Observer {
+  protected:
+    struct NoValue {};
+    // For values without derivatives (Value == Constant) there is only the overload for constants
+    using ObservedValue = typename std::conditional<std::is_same<Value, Constant>::value, NoValue, Value>::type;
+
   public:
     template<typename Var>
     bool observe(const std::string& name, Var v, Time length) {
@@ -67,7 +75,7 @@ class Observer {
         return std::tuple<bool, bool, Time>(false, false, 0);
     }
     virtual bool observe(const std::string& name, TimeSeries<Constant>& v) = 0;
-    virtual bool observe(const std::string& name, const Value& v) {
+    virtual bool observe(const std::string& name, const ObservedValue& v) {
         return true;
     }
     virtual bool observe(const std::string& name, const Constant& v) {
@@ -107,119 +115,174 @@ inline void debug() {
 #endif
 }
 
+// Control variable for values without derivatives
 template<typename Value>
-class Bounded {
-  private:
-    Value val;
-    Value lower;
-    Value upper;
-    inline void check() {
-        if (val < lower) {
-            val = lower;
-        } else if (val > upper) {
-            val = upper;
-        }
-    }
+class PlainVariable {
+  protected:
+    std::vector<Value> val;
 
   public:
-    Bounded(const Value& val_p, const Value& lower_p, const Value& upper_p) : val(val_p), lower(lower_p), upper(upper_p) {
-        check();
+    PlainVariable(size_t /* offset */, size_t /* num */, size_t length, const Value& initial_value, size_t /* stride */ = 1) : val(length, initial_value){};
+    // Values calculated before stay valid, so only those depending on changed variables need to be calculated anew
+    static const bool incremental = true;
+    static inline void rewind(size_t /* variables_num */) {}
+    inline size_t size() const {
+        return val.size();
     }
-    inline Bounded& operator=(const Value& val_p) {
-        val = val_p;
-        check();
-        return *this;
-    }
-    inline operator Value() {
+    inline std::vector<Value>& value() {
         return val;
     }
-    inline operator Value() const {
+    inline Value operator[](size_t i) const {
+        return val[i];
+    }
+    inline Value at(size_t i) const {
+        return val.at(i);
+    }
+};
+
+// Creates values not depending on any of the variables_num control variables
+template<typename Value, typename Constant>
+struct ConstantValue {
+    static inline Value create(size_t variables_num, const Constant& val) {
+        return {variables_num, val};
+    }
+};
+template<typename Constant>
+struct ConstantValue<Constant, Constant> {
+    static inline Constant create(size_t /* variables_num */, const Constant& val) {
         return val;
     }
 };
 
+// Bound policies of stepwise series: the bounds are stored once per series, compared as constants, and a value out of bounds is replaced by the
+// bound itself (as a constant, i.e. without derivative)
 template<typename Value>
+struct Unbounded {
+    inline const Value& operator()(const Value& v) const {
+        return v;
+    }
+};
+
+template<typename Value, typename Constant>
 class LowerBounded {
   private:
-    Value val;
-    Value lower;
-    inline void check() {
-        if (val < lower) {
-            val = lower;
+    Constant lower;
+    Value lower_value;
+
+  public:
+    LowerBounded(const Value& lower_p) : lower(static_cast<Constant>(lower_p)), lower_value(lower_p){};
+    inline const Value& operator()(const Value& v) const {
+        if (static_cast<Constant>(v) < lower) {
+            return lower_value;
         }
+        return v;
     }
+};
+
+template<typename Value, typename Constant>
+class Bounded {
+  private:
+    Constant lower;
+    Constant upper;
+    Value lower_value;
+    Value upper_value;
 
   public:
-    LowerBounded(const Value& val_p, const Value& lower_p) : val(val_p), lower(lower_p) {
-        check();
-    }
-    inline LowerBounded& operator=(const Value& val_p) {
-        val = val_p;
-        check();
-        return *this;
-    }
-    inline operator Value() {
-        return val;
-    }
-    inline operator Value() const {
-        return val;
+    Bounded(const Value& lower_p, const Value& upper_p)
+        : lower(static_cast<Constant>(lower_p)), upper(static_cast<Constant>(upper_p)), lower_value(lower_p), upper_value(upper_p){};
+    inline const Value& operator()(const Value& v) const {
+        const Constant c = static_cast<Constant>(v);
+        if (c < lower) {
+            return lower_value;
+        }
+        if (c > upper) {
+            return upper_value;
+        }
+        return v;
     }
 };
 
+// Value of a stepwise series at a timestep (calculated if necessary) and restarting its calculation from a given value at a timestep, which
+// allows to recalculate a model from a stored state (see CheckpointedModel)
+template<typename Value, typename Time>
+struct State {
+    std::function<Value(Time)> get;
+    std::function<void(Time, const Value&)> restore;
+};
+
+// Values of all stepwise series of a model in one array, row t holding the values of all series at timestep t (time-major), so that the values
+// of a timestep lie next to each other. Only the values themselves are contiguous: derivatives are kept in the storage of each value (arena or
+// tape), hence copying rows copies them one value at a time. Series add their columns when constructed, the storage is allocated once all of them
+// are known.
 template<typename Value, typename Time>
-class BackwardLookingTimeSeries {
+class StateBlock {
   protected:
-    TimeSeries<Value> series;
-    Time largest_valid_t = 0;
-#ifdef DEBUG
-    Time calculating_t = 0;
-#endif
+    std::vector<Value> data;
+    std::vector<Value> initial_values;
 
   public:
-    const Value initial_value;
-    BackwardLookingTimeSeries(Time size, const Value& initial_value_p) : series(size, initial_value_p), initial_value(initial_value_p){};
-    void set_first_value(const Value& first_value) {
-        series[0] = first_value;
-    }
-    const Value& get_first_value() const {
-        return series[0];
+    size_t add_column(const Value& initial_value) {
+        if (!data.empty()) {
+            throw std::runtime_error("state block already allocated");
+        }
+        initial_values.push_back(initial_value);
+        return initial_values.size() - 1;
     }
-
-    template<typename Function>
-    inline const Value& get(Time t, Function func) {
-        if (t > largest_valid_t) {
-#ifdef DEBUG
-            if (calculating_t > 0 && calculating_t <= t) {
-                throw std::runtime_error("equation loop");
-            }
-            calculating_t = t;
-#endif
-            largest_valid_t = func(largest_valid_t, t, series);
-#ifdef DEBUG
-            calculating_t = 0;
-#endif
+    void allocate(Time length) {
+        data.clear();
+        data.reserve(length * initial_values.size());
+        for (Time t = 0; t < length; ++t) {
+            data.insert(std::end(data), std::begin(initial_values), std::end(initial_values));
         }
-        return series[t];
     }
-
-    inline void invalidate_after(Time t) {
-        largest_valid_t = t;
+    inline size_t width() const {
+        return initial_values.size();
     }
-    inline void invalidate() {
-        invalidate_after(0);
+    inline Value& at(Time t, size_t column) {
+        return data[t * initial_values.size() + column];
     }
-    inline void reset() {
-        invalidate();
-        const Value first_value = series[0];
-        std::fill(series.begin(), series.end(), initial_value);
-        series[0] = first_value;
+    inline const Value& at(Time t, size_t column) const {
+        return data[t * initial_values.size() + column];
+    }
+    // Values of all series at t, followed by those at t + 1 etc.
+    inline const Value* row(Time t) const {
+        return &data[t * initial_values.size()];
+    }
+    // Copy of the values of all series up to t
+    std::vector<Value> rows(Time t) const {
+        return std::vector<Value>(std::begin(data), std::begin(data) + (t + 1) * initial_values.size());
+    }
+    // Overwrites the first rows with those given (as returned by rows())
+    void assign_rows(const std::vector<Value>& rows) {
+        if (rows.size() > data.size() || rows.size() % initial_values.size() != 0) {
+            throw std::runtime_error("rows do not fit state block");
+        }
+        std::copy(std::begin(rows), std::end(rows), std::begin(data));
     }
 };
 
+// Storage of a series as column of a StateBlock
 template<typename Value, typename Time>
+class StateColumn {
+  protected:
+    StateBlock<Value, Time>* block;
+    size_t column;
+
+  public:
+    StateColumn(StateBlock<Value, Time>& block_p, const Value& initial_value) : block(&block_p), column(block_p.add_column(initial_value)){};
+    inline Value& operator[](Time t) {
+        return block->at(t, column);
+    }
+    inline const Value& operator[](Time t) const {
+        return block->at(t, column);
+    }
+};
+
+template<typename Value, typename Time, typename Bound = Unbounded<Value>, typename Storage = TimeSeries<Value>>
 class StepwiseBackwardLookingTimeSeries {
   protected:
-    TimeSeries<Value> series;
+    const Bound bound;
+    Storage series;
     Time largest_valid_t = 0;
 #ifdef DEBUG
     Time calculating_t = 0;
@@ -227,13 +290,26 @@ class StepwiseBackwardLookingTimeSeries {
 
   public:
     const Value initial_value;
-    StepwiseBackwardLookingTimeSeries(Time size, const Value& initial_value_p) : series(size, initial_value_p), initial_value(initial_value_p){};
+    StepwiseBackwardLookingTimeSeries(Time size, const Value& initial_value_p, const Bound& bound_p = Bound())
+        : bound(bound_p), series(size, bound(initial_value_p)), initial_value(bound(initial_value_p)){};
+    StepwiseBackwardLookingTimeSeries(StateBlock<Value, Time>& block, const Value& initial_value_p, const Bound& bound_p = Bound())
+        : bound(bound_p), series(block, bound(initial_value_p)), initial_value(bound(initial_value_p)){};
     void set_first_value(const Value& first_value) {
-        series[0] = first_value;
+        series[0] = bound(first_value);
     }
     const Value& get_first_value() const {
         return series[0];
     }
+    // Value at t as stored, i.e. without calculating it (only valid up to the last timestep calculated, checked in DEBUG builds so that the
+    // order of the eager evaluation cannot read stale values)
+    inline const Value& operator[](Time t) const {
+#ifdef DEBUG
+        if (t > largest_valid_t) {
+            throw std::runtime_error("value read before being calculated");
+        }
+#endif
+        return series[t];
+    }
 
     template<typename Function>
     inline const Value& get(Time t, Function func) {
@@ -244,7 +320,7 @@ class StepwiseBackwardLookingTimeSeries {
         calculating_t = t;
 #endif
         for (; t > largest_valid_t; ++largest_valid_t) {
-            series[largest_valid_t + 1] = func(largest_valid_t + 1, series[largest_valid_t]);
+            series[largest_valid_t + 1] = bound(func(largest_valid_t + 1, series[largest_valid_t]));
         }
 #ifdef DEBUG
         calculating_t = 0;
@@ -253,16 +329,55 @@ class StepwiseBackwardLookingTimeSeries {
     }
 
     inline void invalidate_after(Time t) {
-        largest_valid_t = t;
+        largest_valid_t = std::min(largest_valid_t, t);
     }
     inline void invalidate() {
         invalidate_after(0);
     }
+    // Values up to t have been written into the storage directly (e.g. from a snapshot), later ones are calculated anew
+    inline void validate_until(Time t) {
+        largest_valid_t = t;
+    }
+    // Sets the value at t, later values are calculated anew from there
+    inline void restore(Time t, const Value& v) {
+        series[t] = bound(v);
+        largest_valid_t = t;
+    }
+    // Values after the first one are only marked as invalid (and overwritten once calculated again), so this does not depend on the length of the series
     inline void reset() {
         invalidate();
-        const Value first_value = series[0];
-        std::fill(series.begin(), series.end(), initial_value);
-        series[0] = first_value;
+    }
+};
+
+// Stepwise series stored in the state block of a model
+template<typename Value, typename Time, typename Bound = Unbounded<Value>>
+using StateSeries = StepwiseBackwardLookingTimeSeries<Value, Time, Bound, StateColumn<Value, Time>>;
+
+// Series of values only depending on other values at the same timestep (e.g. on states of stepwise series), calculated once for all timesteps up
+// to the one accessed and kept until invalidated, so that equations used by several others are not calculated (and their derivatives copied) anew
+template<typename Value, typename Time>
+class MemoizedTimeSeries {
+  protected:
+    TimeSeries<Value> series;
+    Time valid_num = 0;  // Number of timesteps calculated and still valid
+
+  public:
+    MemoizedTimeSeries(Time size, const Value& initial_value) : series(size, initial_value){};
+
+    template<typename Function>
+    inline const Value& get(Time t, Function func) {
+        for (; valid_num <= t; ++valid_num) {
+            series[valid_num] = func(valid_num);
+        }
+        return series[t];
+    }
+
+    // Values from t on are calculated anew
+    inline void invalidate_from(Time t) {
+        valid_num = std::min(valid_num, t);
+    }
+    inline void reset() {
+        invalidate_from(0);
     }
 };
 }
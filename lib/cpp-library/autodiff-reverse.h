@@ -0,0 +1,593 @@
+/*
+  Copyright (C) 2017 Sven Willner <sven.willner@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU Affero General Public License as published
+  by the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU Affero General Public License for more details.
+
+  You should have received a copy of the GNU Affero General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef AUTODIFF_REVERSE_H
+#define AUTODIFF_REVERSE_H
+
+#include <math.h>
+#include <cmath>
+#include <valarray>
+#include <vector>
+
+namespace autodiff {
+namespace reverse {
+
+static const size_t no_index = static_cast<size_t>(-1);
+
+// Excludes scalar arguments from template argument deduction, so that they may also be given as types convertible to T
+template<typename T>
+struct Identity {
+    using type = T;
+};
+
+// Dual number carrying one directional derivative (the tangent) along with its value; used as tape scalar, the adjoints of the tape hold the
+// gradient in their values and the Hessian multiplied by the seeded direction in their tangents (forward-over-reverse differentiation)
+template<typename T>
+class Dual {
+  protected:
+    T val;
+    T tan;
+
+  public:
+    Dual(const T& val_p = 0, const T& tan_p = 0) : val(val_p), tan(tan_p){};
+    inline const T value() const {
+        return val;
+    }
+    inline const T tangent() const {
+        return tan;
+    }
+    explicit inline operator T() const {
+        return val;
+    }
+
+    inline Dual operator-() const {
+        return {-val, -tan};
+    }
+    inline friend Dual operator+(const Dual& lhs, const Dual& rhs) {
+        return {lhs.val + rhs.val, lhs.tan + rhs.tan};
+    }
+    inline friend Dual operator-(const Dual& lhs, const Dual& rhs) {
+        return {lhs.val - rhs.val, lhs.tan - rhs.tan};
+    }
+    inline friend Dual operator*(const Dual& lhs, const Dual& rhs) {
+        return {lhs.val * rhs.val, lhs.tan * rhs.val + lhs.val * rhs.tan};
+    }
+    inline friend Dual operator/(const Dual& lhs, const Dual& rhs) {
+        return {lhs.val / rhs.val, (lhs.tan * rhs.val - lhs.val * rhs.tan) / (rhs.val * rhs.val)};
+    }
+    inline Dual& operator+=(const Dual& v) {
+        val += v.val;
+        tan += v.tan;
+        return *this;
+    }
+    inline Dual& operator-=(const Dual& v) {
+        val -= v.val;
+        tan -= v.tan;
+        return *this;
+    }
+    inline Dual& operator*=(const Dual& v) {
+        return *this = *this * v;
+    }
+    inline Dual& operator/=(const Dual& v) {
+        return *this = *this / v;
+    }
+
+    // Comparisons only take the values into account
+    inline friend bool operator<(const Dual& lhs, const Dual& rhs) {
+        return lhs.val < rhs.val;
+    }
+    inline friend bool operator<=(const Dual& lhs, const Dual& rhs) {
+        return lhs.val <= rhs.val;
+    }
+    inline friend bool operator>(const Dual& lhs, const Dual& rhs) {
+        return lhs.val > rhs.val;
+    }
+    inline friend bool operator>=(const Dual& lhs, const Dual& rhs) {
+        return lhs.val >= rhs.val;
+    }
+    inline friend bool operator==(const Dual& lhs, const Dual& rhs) {
+        return lhs.val == rhs.val;
+    }
+    inline friend bool operator!=(const Dual& lhs, const Dual& rhs) {
+        return lhs.val != rhs.val;
+    }
+
+    // Found by argument-dependent lookup from the overloads for Value<Dual<T>> below
+    inline friend Dual pow(const Dual& lhs, const Dual& rhs) {
+        // Only the terms for non-zero tangents, as their factors are not finite for a zero base
+        Dual res(std::pow(lhs.val, rhs.val));
+        if (lhs.tan != 0) {
+            res.tan += rhs.val * std::pow(lhs.val, rhs.val - 1) * lhs.tan;
+        }
+        if (rhs.tan != 0) {
+            res.tan += res.val * std::log(lhs.val) * rhs.tan;
+        }
+        return res;
+    }
+    inline friend Dual log(const Dual& v) {
+        return {std::log(v.val), v.tan / v.val};
+    }
+    inline friend Dual log2(const Dual& v) {
+        return {std::log2(v.val), v.tan / (v.val * M_LN2)};
+    }
+    inline friend Dual log10(const Dual& v) {
+        return {std::log10(v.val), v.tan / (v.val * M_LN10)};
+    }
+    inline friend Dual exp(const Dual& v) {
+        const T e = std::exp(v.val);
+        return {e, e * v.tan};
+    }
+};
+
+// Records every operation on non-constant values (one tape per thread), indices [0, variables_num) refer to the variables themselves
+template<typename T>
+class Tape {
+  protected:
+    struct Node {
+        size_t lhs;
+        size_t rhs;
+        T lhs_partial;
+        T rhs_partial;
+    };
+    std::vector<Node> nodes;
+    std::vector<T> adjoints;
+    size_t variables_num = 0;
+
+  public:
+    static Tape& instance() {
+        static thread_local Tape tape;
+        return tape;
+    }
+    inline void rewind(size_t variables_num_p) {
+        variables_num = variables_num_p;
+        nodes.clear();
+    }
+    inline size_t size() const {
+        return nodes.size();
+    }
+    inline size_t record(size_t lhs, const T& lhs_partial, size_t rhs = no_index, const T& rhs_partial = 0) {
+        nodes.push_back({lhs, rhs, lhs_partial, rhs_partial});
+        return variables_num + nodes.size() - 1;
+    }
+    std::valarray<T> gradient(size_t index) {
+        std::valarray<T> res(0.0, variables_num);
+        if (index == no_index) {
+            return res;
+        }
+        adjoints.assign(index + 1, 0);
+        adjoints[index] = 1;
+        for (size_t i = index + 1; i-- > variables_num;) {
+            const T adjoint = adjoints[i];
+            if (adjoint != 0) {
+                const Node& node = nodes[i - variables_num];
+                adjoints[node.lhs] += adjoint * node.lhs_partial;
+                if (node.rhs != no_index) {
+                    adjoints[node.rhs] += adjoint * node.rhs_partial;
+                }
+            }
+        }
+        for (size_t i = 0; i < variables_num && i <= index; ++i) {
+            res[i] = adjoints[i];
+        }
+        return res;
+    }
+};
+
+template<typename T>
+class Variable;
+template<typename T>
+class Value;
+}
+}
+
+namespace std {
+
+template<typename T>
+autodiff::reverse::Value<T> pow(const autodiff::reverse::Value<T>& lhs, const autodiff::reverse::Value<T>& rhs);
+template<typename T>
+autodiff::reverse::Value<T> pow(const typename autodiff::reverse::Identity<T>::type& val, const autodiff::reverse::Value<T>& rhs);
+template<typename T>
+autodiff::reverse::Value<T> pow(const autodiff::reverse::Value<T>& lhs, const typename autodiff::reverse::Identity<T>::type& val);
+
+template<typename T>
+autodiff::reverse::Value<T> log(const autodiff::reverse::Value<T>& v);
+template<typename T>
+autodiff::reverse::Value<T> log2(const autodiff::reverse::Value<T>& v);
+template<typename T>
+autodiff::reverse::Value<T> log10(const autodiff::reverse::Value<T>& v);
+template<typename T>
+autodiff::reverse::Value<T> exp(const autodiff::reverse::Value<T>& v);
+
+template<typename T>
+autodiff::reverse::Value<T> min(const typename autodiff::reverse::Identity<T>::type& val, const autodiff::reverse::Value<T>& rhs);
+template<typename T>
+autodiff::reverse::Value<T> min(const autodiff::reverse::Value<T>& lhs, const typename autodiff::reverse::Identity<T>::type& val);
+
+template<typename T>
+autodiff::reverse::Value<T> max(const typename autodiff::reverse::Identity<T>::type& val, const autodiff::reverse::Value<T>& rhs);
+template<typename T>
+autodiff::reverse::Value<T> max(const autodiff::reverse::Value<T>& lhs, const typename autodiff::reverse::Identity<T>::type& val);
+}
+
+namespace autodiff {
+namespace reverse {
+
+template<typename T>
+class Value {
+    friend class Variable<T>;
+
+  protected:
+    T val;
+    size_t index;
+    Value() = default;
+    static inline Value unary(const T& val_p, const Value& v, const T& partial) {
+        Value res;
+        res.val = val_p;
+        res.index = v.index == no_index ? no_index : Tape<T>::instance().record(v.index, partial);
+        return res;
+    }
+    static inline Value binary(const T& val_p, const Value& lhs, const T& lhs_partial, const Value& rhs, const T& rhs_partial) {
+        if (lhs.index == no_index) {
+            return unary(val_p, rhs, rhs_partial);
+        }
+        if (rhs.index == no_index) {
+            return unary(val_p, lhs, lhs_partial);
+        }
+        Value res;
+        res.val = val_p;
+        res.index = Tape<T>::instance().record(lhs.index, lhs_partial, rhs.index, rhs_partial);
+        return res;
+    }
+
+  public:
+    Value(size_t /* n */, const T& val_p) : val(val_p), index(no_index){};
+    Value(size_t i, size_t /* n */, const T& val_p) : val(val_p), index(i){};
+    inline const T value() const {
+        return val;
+    }
+    // Also converts to types T itself converts to (e.g. the value part of a Dual)
+    template<typename C>
+    explicit inline operator C() const {
+        return static_cast<C>(val);
+    }
+    // Runs the adjoint sweep over the tape, so bind the result once instead of calling this repeatedly
+    inline std::valarray<T> derivative() const {
+        return Tape<T>::instance().gradient(index);
+    }
+
+    inline Value operator-() const {
+        return unary(-val, *this, -1);
+    }
+
+    inline friend Value operator+(const Value& lhs, const Value& rhs) {
+        return binary(lhs.val + rhs.val, lhs, 1, rhs, 1);
+    }
+    inline friend Value operator+(const T& val, const Value& rhs) {
+        return unary(val + rhs.val, rhs, 1);
+    }
+    inline friend Value operator+(const Value& lhs, const T& val) {
+        return unary(lhs.val + val, lhs, 1);
+    }
+
+    inline friend Value operator-(const Value& lhs, const Value& rhs) {
+        return binary(lhs.val - rhs.val, lhs, 1, rhs, -1);
+    }
+    inline friend Value operator-(const T& val, const Value& rhs) {
+        return unary(val - rhs.val, rhs, -1);
+    }
+    inline friend Value operator-(const Value& lhs, const T& val) {
+        return unary(lhs.val - val, lhs, 1);
+    }
+
+    inline friend Value operator*(const Value& lhs, const Value& rhs) {
+        return binary(lhs.val * rhs.val, lhs, rhs.val, rhs, lhs.val);
+    }
+    inline friend Value operator*(const T& val, const Value& rhs) {
+        return unary(val * rhs.val, rhs, val);
+    }
+    inline friend Value operator*(const Value& lhs, const T& val) {
+        return unary(lhs.val * val, lhs, val);
+    }
+
+    inline friend Value operator/(const Value& lhs, const Value& rhs) {
+        return binary(lhs.val / rhs.val, lhs, 1 / rhs.val, rhs, -lhs.val / rhs.val / rhs.val);
+    }
+    inline friend Value operator/(const T& val, const Value& rhs) {
+        return unary(val / rhs.val, rhs, -val / rhs.val / rhs.val);
+    }
+    inline friend Value operator/(const Value& lhs, const T& val) {
+        return unary(lhs.val / val, lhs, 1 / val);
+    }
+
+    inline Value& operator+=(const Value& v) {
+        return *this = *this + v;
+    }
+    inline Value& operator+=(const T& v) {
+        val += v;
+        return *this;
+    }
+
+    inline Value& operator-=(const Value& v) {
+        return *this = *this - v;
+    }
+    inline Value& operator-=(const T& v) {
+        val -= v;
+        return *this;
+    }
+
+    inline Value& operator*=(const Value& v) {
+        return *this = *this * v;
+    }
+    inline Value& operator*=(const T& v) {
+        return *this = *this * v;
+    }
+
+    inline Value& operator/=(const Value& v) {
+        return *this = *this / v;
+    }
+    inline Value& operator/=(const T& v) {
+        return *this = *this / v;
+    }
+
+    inline friend bool operator<(const Value& lhs, const Value& rhs) {
+        return lhs.val < rhs.val;
+    }
+    inline friend bool operator<(const T& val, const Value& rhs) {
+        return val < rhs.val;
+    }
+    inline friend bool operator<(const Value& lhs, const T& val) {
+        return lhs.val < val;
+    }
+
+    inline friend bool operator<=(const Value& lhs, const Value& rhs) {
+        return lhs.val <= rhs.val;
+    }
+    inline friend bool operator<=(const T& val, const Value& rhs) {
+        return val <= rhs.val;
+    }
+    inline friend bool operator<=(const Value& lhs, const T& val) {
+        return lhs.val <= val;
+    }
+
+    inline friend bool operator>(const Value& lhs, const Value& rhs) {
+        return lhs.val > rhs.val;
+    }
+    inline friend bool operator>(const T& val, const Value& rhs) {
+        return val > rhs.val;
+    }
+    inline friend bool operator>(const Value& lhs, const T& val) {
+        return lhs.val > val;
+    }
+
+    inline friend bool operator>=(const Value& lhs, const Value& rhs) {
+        return lhs.val >= rhs.val;
+    }
+    inline friend bool operator>=(const T& val, const Value& rhs) {
+        return val >= rhs.val;
+    }
+    inline friend bool operator>=(const Value& lhs, const T& val) {
+        return lhs.val >= val;
+    }
+
+    inline friend bool operator==(const Value& lhs, const Value& rhs) {
+        return lhs.val == rhs.val;
+    }
+    inline friend bool operator==(const T& val, const Value& rhs) {
+        return val == rhs.val;
+    }
+    inline friend bool operator==(const Value& lhs, const T& val) {
+        return lhs.val == val;
+    }
+
+    inline friend bool operator!=(const Value& lhs, const Value& rhs) {
+        return lhs.val != rhs.val;
+    }
+    inline friend bool operator!=(const T& val, const Value& rhs) {
+        return val != rhs.val;
+    }
+    inline friend bool operator!=(const Value& lhs, const T& val) {
+        return lhs.val != val;
+    }
+
+    friend Value std::pow<T>(const Value& lhs, const Value& rhs);
+    friend Value std::pow<T>(const typename autodiff::reverse::Identity<T>::type& val, const Value& rhs);
+    friend Value std::pow<T>(const Value& lhs, const typename autodiff::reverse::Identity<T>::type& val);
+
+    friend Value std::log<T>(const Value& v);
+    friend Value std::log2<T>(const Value& v);
+    friend Value std::log10<T>(const Value& v);
+    friend Value std::exp<T>(const Value& v);
+
+    friend Value std::min<T>(const typename autodiff::reverse::Identity<T>::type& val, const Value& rhs);
+    friend Value std::min<T>(const Value& lhs, const typename autodiff::reverse::Identity<T>::type& val);
+
+    friend Value std::max<T>(const typename autodiff::reverse::Identity<T>::type& val, const Value& rhs);
+    friend Value std::max<T>(const Value& lhs, const typename autodiff::reverse::Identity<T>::type& val);
+};
+
+template<typename T>
+class Variable {
+  protected:
+    std::vector<T> val;
+    const size_t variables_num;
+    const size_t variables_offset;
+    const size_t variables_stride;
+
+  public:
+    // Element i is variable offset + i * stride of num variables (none if offset >= num), a stride > 1 interleaving several Variables
+    Variable(size_t offset, size_t num, size_t length, const T& initial_value, size_t stride = 1)
+        : val(length, initial_value), variables_num(num), variables_offset(offset), variables_stride(stride){};
+    // Values calculated before a rewind refer to discarded operations, so all of them need to be calculated anew
+    static const bool incremental = false;
+    // Discards all operations recorded so far (to be called before each new evaluation)
+    static inline void rewind(size_t variables_num) {
+        Tape<T>::instance().rewind(variables_num);
+    }
+    inline const Variable& operator=(const std::vector<T>& val_p) {
+        val.assign(val_p);
+        return *this;
+    }
+    inline size_t size() const {
+        return val.size();
+    }
+    inline std::vector<T>& value() {
+        return val;
+    }
+    inline Value<T> operator[](size_t i) const {
+        if (variables_offset < variables_num) {
+            return {variables_offset + i * variables_stride, variables_num, val[i]};
+        } else {
+            return {variables_num, val[i]};
+        }
+    }
+    inline Value<T> at(size_t i) const {
+        if (variables_offset < variables_num) {
+            return {variables_offset + i * variables_stride, variables_num, val.at(i)};
+        } else {
+            return {variables_num, val.at(i)};
+        }
+    }
+};
+
+// Variable whose values are seeded with the tangents given by direction(), so that the gradient of a result carries the Hessian multiplied by
+// that direction in its tangents (values are plain T, so that it can be used in place of Variable<T>)
+template<typename T>
+class DualVariable {
+  protected:
+    std::vector<T> val;
+    std::vector<T> tangents;
+    const size_t variables_num;
+    const size_t variables_offset;
+    const size_t variables_stride;
+
+  public:
+    DualVariable(size_t offset, size_t num, size_t length, const T& initial_value, size_t stride = 1)
+        : val(length, initial_value), tangents(length, 0), variables_num(num), variables_offset(offset), variables_stride(stride){};
+    static const bool incremental = false;
+    static inline void rewind(size_t variables_num) {
+        Tape<Dual<T>>::instance().rewind(variables_num);
+    }
+    inline const DualVariable& operator=(const std::vector<T>& val_p) {
+        val.assign(val_p);
+        return *this;
+    }
+    inline size_t size() const {
+        return val.size();
+    }
+    inline std::vector<T>& value() {
+        return val;
+    }
+    inline std::vector<T>& direction() {
+        return tangents;
+    }
+    // Takes the direction over the first length variables and sets the tangent of each element to the entry of its variable (zero for those
+    // beyond length)
+    void set_direction(const T* direction_p, size_t length) {
+        for (size_t i = 0; i < tangents.size(); ++i) {
+            const size_t index = variables_offset + i * variables_stride;
+            tangents[i] = variables_offset < variables_num && index < length ? direction_p[index] : 0;
+        }
+    }
+    inline Value<Dual<T>> operator[](size_t i) const {
+        if (variables_offset < variables_num) {
+            return {variables_offset + i * variables_stride, variables_num, {val[i], tangents[i]}};
+        } else {
+            return {variables_num, val[i]};
+        }
+    }
+    inline Value<Dual<T>> at(size_t i) const {
+        if (variables_offset < variables_num) {
+            return {variables_offset + i * variables_stride, variables_num, {val.at(i), tangents.at(i)}};
+        } else {
+            return {variables_num, val.at(i)};
+        }
+    }
+};
+}
+}
+
+namespace std {
+
+template<typename T>
+inline autodiff::reverse::Value<T> pow(const autodiff::reverse::Value<T>& lhs, const autodiff::reverse::Value<T>& rhs) {
+    const T p = pow(lhs.val, rhs.val);
+    return autodiff::reverse::Value<T>::binary(p, lhs, p * rhs.val / lhs.val, rhs, log(lhs.val) * p);
+}
+template<typename T>
+inline autodiff::reverse::Value<T> pow(const typename autodiff::reverse::Identity<T>::type& val, const autodiff::reverse::Value<T>& rhs) {
+    const T p = pow(val, rhs.val);
+    return autodiff::reverse::Value<T>::unary(p, rhs, p * log(val));
+}
+template<typename T>
+inline autodiff::reverse::Value<T> pow(const autodiff::reverse::Value<T>& lhs, const typename autodiff::reverse::Identity<T>::type& val) {
+    return autodiff::reverse::Value<T>::unary(pow(lhs.val, val), lhs, val * pow(lhs.val, val - 1));
+}
+
+template<typename T>
+inline autodiff::reverse::Value<T> log(const autodiff::reverse::Value<T>& v) {
+    return autodiff::reverse::Value<T>::unary(log(v.val), v, 1 / v.val);
+}
+template<typename T>
+inline autodiff::reverse::Value<T> log2(const autodiff::reverse::Value<T>& v) {
+    return autodiff::reverse::Value<T>::unary(log2(v.val), v, 1 / (v.val * M_LN2));
+}
+template<typename T>
+inline autodiff::reverse::Value<T> log10(const autodiff::reverse::Value<T>& v) {
+    return autodiff::reverse::Value<T>::unary(log10(v.val), v, 1 / (v.val * M_LN10));
+}
+template<typename T>
+inline autodiff::reverse::Value<T> exp(const autodiff::reverse::Value<T>& v) {
+    const T e = exp(v.val);
+    return autodiff::reverse::Value<T>::unary(e, v, e);
+}
+
+template<typename T>
+inline autodiff::reverse::Value<T> min(const typename autodiff::reverse::Identity<T>::type& val, const autodiff::reverse::Value<T>& rhs) {
+    if (val < rhs.val) {
+        return {0, val};
+    } else {
+        return rhs;
+    }
+}
+template<typename T>
+inline autodiff::reverse::Value<T> min(const autodiff::reverse::Value<T>& lhs, const typename autodiff::reverse::Identity<T>::type& val) {
+    if (lhs.val < val) {
+        return lhs;
+    } else {
+        return {0, val};
+    }
+}
+
+template<typename T>
+inline autodiff::reverse::Value<T> max(const typename autodiff::reverse::Identity<T>::type& val, const autodiff::reverse::Value<T>& rhs) {
+    if (val < rhs.val) {
+        return rhs;
+    } else {
+        return {0, val};
+    }
+}
+template<typename T>
+inline autodiff::reverse::Value<T> max(const autodiff::reverse::Value<T>& lhs, const typename autodiff::reverse::Identity<T>::type& val) {
+    if (lhs.val < val) {
+        return {0, val};
+    } else {
+        return lhs;
+    }
+}
+}
+
+#endif
@@ -19,8 +19,16 @@
 #define AUTODIFF_H
 
 #include <math.h>
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <utility>
 #include <valarray>
 #include <vector>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 namespace autodiff {
 
@@ -28,223 +36,696 @@ template<typename T, typename Vector = std::valarray<T>>
 class Variable;
 template<typename T, typename Vector = std::valarray<T>>
 class Value;
-}
+template<typename T, typename Vector = std::valarray<T>>
+class SeededVariable;
 
-namespace std {
+// Prevents deduction of T from constant operands, so that e.g. integer literals can be used
+template<typename T>
+struct Identity {
+    using type = T;
+};
 
-template<typename T, typename Vector>
-autodiff::Value<T, Vector> pow(const autodiff::Value<T, Vector>& lhs, const autodiff::Value<T, Vector>& rhs);
-template<typename T, typename Vector>
-autodiff::Value<T, Vector> pow(const T& val, const autodiff::Value<T, Vector>& rhs);
-template<typename T, typename Vector>
-autodiff::Value<T, Vector> pow(const autodiff::Value<T, Vector>& lhs, const T& val);
+// Thread-local bump allocator for derivative vectors. Memory given back is kept in free lists per size class and recycled, so once the blocks taken
+// from the heap are large enough, no more heap allocations are needed. Blocks are never released: the values kept by models between evaluations
+// hold chunks in all of them. Chunks have to be given back by the thread which allocated them (checked in DEBUG builds).
+class Arena {
+  protected:
+    static const size_t block_size = 1 << 20;
+    static const size_t classes_num = 4 * 8 * sizeof(size_t);
+    struct Chunk {
+        Chunk* next;
+    };
+    std::vector<std::pair<std::unique_ptr<char[]>, size_t>> blocks;
+    size_t block = 0;
+    size_t used = 0;
+    Chunk* free_chunks[classes_num] = {};
 
-template<typename T, typename Vector>
-autodiff::Value<T, Vector> log(const autodiff::Value<T, Vector>& v);
-template<typename T, typename Vector>
-autodiff::Value<T, Vector> log2(const autodiff::Value<T, Vector>& v);
-template<typename T, typename Vector>
-autodiff::Value<T, Vector> log10(const autodiff::Value<T, Vector>& v);
-template<typename T, typename Vector>
-autodiff::Value<T, Vector> exp(const autodiff::Value<T, Vector>& v);
+    // Multiples of 16 bytes up to 64 bytes, above four classes per power of two
+    static inline size_t size_class(size_t size) {
+        if (size <= 64) {
+            return size == 0 ? 0 : (size - 1) / 16;
+        }
+        size_t e = 6;
+        while ((static_cast<size_t>(1) << (e + 1)) < size) {
+            ++e;
+        }
+        return 4 * e - 20 + (((size - 1) >> (e - 2)) & 3);
+    }
+    static inline size_t class_size(size_t c) {
+        if (c < 4) {
+            return 16 * (c + 1);
+        }
+        return (5 + (c & 3)) << ((c + 20) / 4 - 2);
+    }
 
-template<typename T, typename Vector>
-autodiff::Value<T, Vector> min(const T& val, const autodiff::Value<T, Vector>& rhs);
-template<typename T, typename Vector>
-autodiff::Value<T, Vector> min(const autodiff::Value<T, Vector>& lhs, const T& val);
+#ifdef DEBUG
+    bool owns(const void* p) const {
+        const char* c = static_cast<const char*>(p);
+        for (const auto& b : blocks) {
+            if (c >= b.first.get() && c < b.first.get() + b.second) {
+                return true;
+            }
+        }
+        return false;
+    }
+#endif
 
-template<typename T, typename Vector>
-autodiff::Value<T, Vector> max(const T& val, const autodiff::Value<T, Vector>& rhs);
-template<typename T, typename Vector>
-autodiff::Value<T, Vector> max(const autodiff::Value<T, Vector>& lhs, const T& val);
-}
+  public:
+    // Statistics since last reset_statistics()
+    size_t allocations = 0;
+    size_t bytes = 0;
+    size_t heap_allocations = 0;
 
-namespace autodiff {
+    static Arena& instance() {
+        static thread_local Arena arena;
+        return arena;
+    }
+    void* allocate(size_t size) {
+        const size_t c = size_class(size);
+        ++allocations;
+        bytes += size;
+        if (free_chunks[c]) {
+            Chunk* res = free_chunks[c];
+            free_chunks[c] = res->next;
+            return res;
+        }
+        size = class_size(c);
+        while (block < blocks.size() && used + size > blocks[block].second) {
+            ++block;
+            used = 0;
+        }
+        if (block == blocks.size()) {
+            const size_t new_size = size > block_size ? size : block_size;
+            blocks.emplace_back(std::unique_ptr<char[]>(new char[new_size]), new_size);
+            ++heap_allocations;
+        }
+        void* res = blocks[block].first.get() + used;
+        used += size;
+        return res;
+    }
+    void deallocate(void* p, size_t size) {
+#ifdef DEBUG
+        if (!owns(p)) {
+            throw std::runtime_error("derivative storage given back by another thread than the one allocating it");
+        }
+#endif
+        const size_t c = size_class(size);
+        Chunk* chunk = static_cast<Chunk*>(p);
+        chunk->next = free_chunks[c];
+        free_chunks[c] = chunk;
+    }
+    void reset_statistics() {
+        allocations = 0;
+        bytes = 0;
+        heap_allocations = 0;
+    }
+};
 
-template<typename T, typename Vector>
-class Value {
-    friend class Variable<T, Vector>;
+template<typename T>
+class ArenaAllocator {
+  public:
+    using value_type = T;
+
+    ArenaAllocator() = default;
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U>&){};
+    inline T* allocate(size_t num) {
+        return static_cast<T*>(Arena::instance().allocate(num * sizeof(T)));
+    }
+    inline void deallocate(T* p, size_t num) {
+        Arena::instance().deallocate(p, num * sizeof(T));
+    }
+    template<typename U>
+    inline bool operator==(const ArenaAllocator<U>&) const {
+        return true;
+    }
+    template<typename U>
+    inline bool operator!=(const ArenaAllocator<U>&) const {
+        return false;
+    }
+};
 
+// Derivative vector of logical size n only storing the range [offset, offset + data.size()) that may be nonzero, all other entries are zero
+template<typename T, typename Allocator = std::allocator<T>>
+class RangeVector {
   protected:
-    T val;
-    Vector dev;
-    Value(const T& val_p, const Vector& dev_p) : val(val_p), dev(dev_p){};
+    size_t n = 0;
+    size_t offset = 0;
+    std::vector<T, Allocator> data;
+
+    inline size_t end() const {
+        return offset + data.size();
+    }
+    inline bool contains(const RangeVector& v) const {
+        return v.data.empty() || (!data.empty() && v.offset >= offset && v.end() <= end());
+    }
+    // Applies d = func(d, other) on the range of target, which is reused if it already covers the range of other
+    template<typename Function>
+    static inline RangeVector combine(RangeVector&& target, const RangeVector& other, Function func) {
+        if (other.data.empty()) {
+            return std::move(target);
+        }
+        if (!target.contains(other)) {
+            RangeVector res;
+            res.n = target.n;
+            res.offset = target.data.empty() ? other.offset : std::min(target.offset, other.offset);
+            res.data.resize((target.data.empty() ? other.end() : std::max(target.end(), other.end())) - res.offset, 0);
+            std::copy(std::begin(target.data), std::end(target.data), std::begin(res.data) + (target.offset - res.offset));
+            target = std::move(res);
+        }
+        T* d = &target.data[other.offset - target.offset];
+        for (size_t i = 0; i < other.data.size(); ++i) {
+            d[i] = func(d[i], other.data[i]);
+        }
+        return std::move(target);
+    }
 
   public:
-    Value(size_t n, const T& val_p) : val(val_p), dev(0.0, n){};
-    Value(size_t i, size_t n, const T& val_p) : val(val_p), dev(0.0, n) {
-        dev[i] = 1;
+    RangeVector() = default;
+    RangeVector(const T& val, size_t n_p) : n(n_p) {
+        if (val != 0) {
+            data.resize(n, val);
+        }
     }
-    inline const T value() const {
-        return val;
+    RangeVector(const RangeVector&) = default;
+    RangeVector(RangeVector&&) = default;
+    // Does not keep the previous storage, so that e.g. resetting values to constants gives back all their memory
+    inline RangeVector& operator=(const RangeVector& other) {
+        return *this = RangeVector(other);
     }
-    explicit inline operator T() const {
-        return val;
+    RangeVector& operator=(RangeVector&&) = default;
+
+    inline friend void extend_bounds(const RangeVector& v, size_t& begin, size_t& end) {
+        if (!v.data.empty()) {
+            begin = std::min(begin, v.offset);
+            end = std::max(end, v.end());
+        }
     }
-    inline const Vector& derivative() const {
-        return dev;
+    inline friend void assign_zero(RangeVector& v, size_t n_p, size_t begin, size_t end) {
+        v.n = n_p;
+        if (begin < end) {
+            v.offset = begin;
+            v.data.assign(end - begin, 0);
+        } else {
+            v.offset = 0;
+            v.data.clear();
+        }
+    }
+    // res needs to cover the range of v already
+    inline friend void add_scaled(RangeVector& res, const T& factor, const RangeVector& v) {
+        if (!v.data.empty()) {
+            T* d = &res.data[v.offset - res.offset];
+            for (size_t i = 0; i < v.data.size(); ++i) {
+                d[i] += factor * v.data[i];
+            }
+        }
+    }
+    inline size_t size() const {
+        return n;
+    }
+    inline T operator[](size_t i) const {
+        if (i < offset || i >= end()) {
+            return 0;
+        }
+        return data[i - offset];
+    }
+    inline T& operator[](size_t i) {
+        if (data.empty()) {
+            offset = i;
+            data.resize(1, 0);
+        } else if (i < offset) {
+            data.insert(std::begin(data), offset - i, 0);
+            offset = i;
+        } else if (i >= end()) {
+            data.resize(i + 1 - offset, 0);
+        }
+        return data[i - offset];
     }
 
-    inline Value operator-() {
-        return {-val, -dev};
+    inline friend RangeVector operator-(RangeVector v) {
+        for (auto&& d : v.data) {
+            d = -d;
+        }
+        return v;
     }
 
-    inline friend Value operator+(const Value& lhs, const Value& rhs) {
-        return {lhs.val + rhs.val, lhs.dev + rhs.dev};
+    inline friend RangeVector operator+(const RangeVector& lhs, const RangeVector& rhs) {
+        return RangeVector(lhs) + rhs;
     }
-    inline friend Value operator+(const T& val, const Value& rhs) {
-        return {val + rhs.val, rhs.dev};
+    inline friend RangeVector operator+(RangeVector&& lhs, const RangeVector& rhs) {
+        return combine(std::move(lhs), rhs, [](const T& l, const T& r) { return l + r; });
     }
-    inline friend Value operator+(const Value& lhs, const T& val) {
-        return {lhs.val + val, lhs.dev};
+    inline friend RangeVector operator+(const RangeVector& lhs, RangeVector&& rhs) {
+        return std::move(rhs) + lhs;
+    }
+    inline friend RangeVector operator+(RangeVector&& lhs, RangeVector&& rhs) {
+        if (rhs.contains(lhs)) {
+            return std::move(rhs) + lhs;
+        }
+        return std::move(lhs) + rhs;
     }
 
-    inline friend Value operator-(const Value& lhs, const Value& rhs) {
-        return {lhs.val - rhs.val, lhs.dev - rhs.dev};
+    inline friend RangeVector operator-(const RangeVector& lhs, const RangeVector& rhs) {
+        return RangeVector(lhs) - rhs;
     }
-    inline friend Value operator-(const T& val, const Value& rhs) {
-        return {val - rhs.val, -rhs.dev};
+    inline friend RangeVector operator-(RangeVector&& lhs, const RangeVector& rhs) {
+        return combine(std::move(lhs), rhs, [](const T& l, const T& r) { return l - r; });
     }
-    inline friend Value operator-(const Value& lhs, const T& val) {
-        return {lhs.val - val, lhs.dev};
+    inline friend RangeVector operator-(const RangeVector& lhs, RangeVector&& rhs) {
+        return combine(std::move(rhs), lhs, [](const T& r, const T& l) { return l - r; });
+    }
+    inline friend RangeVector operator-(RangeVector&& lhs, RangeVector&& rhs) {
+        if (rhs.contains(lhs)) {
+            return lhs - std::move(rhs);
+        }
+        return std::move(lhs) - rhs;
     }
 
-    inline friend Value operator*(const Value& lhs, const Value& rhs) {
-        return {lhs.val * rhs.val, lhs.dev * rhs.val + lhs.val * rhs.dev};
+    inline friend RangeVector operator*(const RangeVector& lhs, const T& val) {
+        RangeVector res;
+        res.n = lhs.n;
+        res.offset = lhs.offset;
+        res.data.resize(lhs.data.size());
+        for (size_t i = 0; i < lhs.data.size(); ++i) {
+            res.data[i] = lhs.data[i] * val;
+        }
+        return res;
     }
-    inline friend Value operator*(const T& val, const Value& rhs) {
-        return {val * rhs.val, val * rhs.dev};
+    inline friend RangeVector operator*(RangeVector&& lhs, const T& val) {
+        return std::move(lhs *= val);
     }
-    inline friend Value operator*(const Value& lhs, const T& val) {
-        return {lhs.val * val, lhs.dev * val};
+    inline friend RangeVector operator*(const T& val, const RangeVector& rhs) {
+        return rhs * val;
     }
-
-    inline friend Value operator/(const Value& lhs, const Value& rhs) {
-        return {lhs.val / rhs.val, lhs.dev / rhs.val - rhs.dev * (lhs.val / rhs.val / rhs.val)};
+    inline friend RangeVector operator*(const T& val, RangeVector&& rhs) {
+        return std::move(rhs *= val);
     }
-    inline friend Value operator/(const T& val, const Value& rhs) {
-        return {val / rhs.val, rhs.dev * (-val / rhs.val / rhs.val)};
+    inline friend RangeVector operator/(const RangeVector& lhs, const T& val) {
+        RangeVector res;
+        res.n = lhs.n;
+        res.offset = lhs.offset;
+        res.data.resize(lhs.data.size());
+        for (size_t i = 0; i < lhs.data.size(); ++i) {
+            res.data[i] = lhs.data[i] / val;
+        }
+        return res;
     }
-    inline friend Value operator/(const Value& lhs, const T& val) {
-        return {lhs.val / val, lhs.dev / val};
+    inline friend RangeVector operator/(RangeVector&& lhs, const T& val) {
+        return std::move(lhs /= val);
     }
 
-    inline Value& operator+=(const Value& v) {
-        val += v.val;
-        dev += v.dev;
+    inline RangeVector& operator+=(const RangeVector& v) {
+        return *this = std::move(*this) + v;
+    }
+    inline RangeVector& operator-=(const RangeVector& v) {
+        return *this = std::move(*this) - v;
+    }
+    inline RangeVector& operator*=(const T& val) {
+        for (auto&& d : data) {
+            d *= val;
+        }
         return *this;
     }
-    inline Value& operator+=(const T& val) {
-        val += val;
+    inline RangeVector& operator/=(const T& val) {
+        for (auto&& d : data) {
+            d /= val;
+        }
         return *this;
     }
+};
 
-    inline Value& operator-=(const Value& v) {
-        val -= v.val;
-        dev -= v.dev;
-        return *this;
+namespace kernels {
+
+// res += a * x
+template<typename T>
+inline void add_scaled(T* res, const T& a, const T* x, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        res[i] += a * x[i];
     }
-    inline Value& operator-=(const T& val) {
-        val -= val;
-        return *this;
+}
+
+// res += a * x + b * y
+template<typename T>
+inline void add_scaled(T* res, const T& a, const T* x, const T& b, const T* y, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        res[i] = res[i] + a * x[i] + b * y[i];
+    }
+}
+
+// Products and sums are kept separate (no fused multiply-add), so that results do not depend on the instruction set
+#if defined(__AVX512F__)
+inline void add_scaled(double* res, const double& a, const double* x, size_t n) {
+    const __m512d va = _mm512_set1_pd(a);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(res + i, _mm512_add_pd(_mm512_loadu_pd(res + i), _mm512_mul_pd(va, _mm512_loadu_pd(x + i))));
     }
+    add_scaled<double>(res + i, a, x + i, n - i);
+}
+inline void add_scaled(double* res, const double& a, const double* x, const double& b, const double* y, size_t n) {
+    const __m512d va = _mm512_set1_pd(a);
+    const __m512d vb = _mm512_set1_pd(b);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        const __m512d r = _mm512_add_pd(_mm512_loadu_pd(res + i), _mm512_mul_pd(va, _mm512_loadu_pd(x + i)));
+        _mm512_storeu_pd(res + i, _mm512_add_pd(r, _mm512_mul_pd(vb, _mm512_loadu_pd(y + i))));
+    }
+    add_scaled<double>(res + i, a, x + i, b, y + i, n - i);
+}
+#elif defined(__AVX2__)
+inline void add_scaled(double* res, const double& a, const double* x, size_t n) {
+    const __m256d va = _mm256_set1_pd(a);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(res + i, _mm256_add_pd(_mm256_loadu_pd(res + i), _mm256_mul_pd(va, _mm256_loadu_pd(x + i))));
+    }
+    add_scaled<double>(res + i, a, x + i, n - i);
+}
+inline void add_scaled(double* res, const double& a, const double* x, const double& b, const double* y, size_t n) {
+    const __m256d va = _mm256_set1_pd(a);
+    const __m256d vb = _mm256_set1_pd(b);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        const __m256d r = _mm256_add_pd(_mm256_loadu_pd(res + i), _mm256_mul_pd(va, _mm256_loadu_pd(x + i)));
+        _mm256_storeu_pd(res + i, _mm256_add_pd(r, _mm256_mul_pd(vb, _mm256_loadu_pd(y + i))));
+    }
+    add_scaled<double>(res + i, a, x + i, b, y + i, n - i);
+}
+#endif
+}
 
-    inline Value& operator*=(const Value& v) {
-        val *= v.val;
-        dev = dev * v.val + v.dev * val;
+// Dense derivative vector with the number of variables N known at compile time. Storage is not over-aligned, as values live in std::vector and heap
+// allocations only respect extended alignment from C++17 on, so the kernels use unaligned loads and stores.
+template<typename T, size_t N>
+class FixedDerivative {
+  protected:
+    T data[N];
+
+  public:
+    FixedDerivative() = default;
+    // n has to be N, only there for compatibility with the other vector types
+    FixedDerivative(const T& val, size_t /* n */) {
+        std::fill(data, data + N, val);
+    }
+
+    inline friend void extend_bounds(const FixedDerivative& /* v */, size_t& begin, size_t& end) {
+        begin = 0;
+        end = N;
+    }
+    inline friend void assign_zero(FixedDerivative& v, size_t /* n */, size_t /* begin */, size_t /* end */) {
+        std::fill(v.data, v.data + N, 0);
+    }
+    inline friend void add_scaled(FixedDerivative& res, const T& factor, const FixedDerivative& v) {
+        kernels::add_scaled(res.data, factor, v.data, N);
+    }
+    inline friend void add_scaled(FixedDerivative& res, const T& a, const FixedDerivative& x, const T& b, const FixedDerivative& y) {
+        kernels::add_scaled(res.data, a, x.data, b, y.data, N);
+    }
+    inline size_t size() const {
+        return N;
+    }
+    inline const T& operator[](size_t i) const {
+        return data[i];
+    }
+    inline T& operator[](size_t i) {
+        return data[i];
+    }
+
+    inline FixedDerivative& operator+=(const FixedDerivative& v) {
+        kernels::add_scaled(data, T(1), v.data, N);
         return *this;
     }
-    inline Value& operator*=(const T& val) {
-        val *= val;
-        dev *= val;
+    inline FixedDerivative& operator-=(const FixedDerivative& v) {
+        kernels::add_scaled(data, T(-1), v.data, N);
         return *this;
     }
-
-    inline Value& operator/=(const Value& v) {
-        val /= v.val;
-        dev = dev / v.val - v.dev * val / v.val / v.val;
+    inline FixedDerivative& operator*=(const T& val) {
+        for (size_t i = 0; i < N; ++i) {
+            data[i] *= val;
+        }
         return *this;
     }
-    inline Value& operator/=(const T& val) {
-        val /= val;
-        dev /= val;
+    inline FixedDerivative& operator/=(const T& val) {
+        for (size_t i = 0; i < N; ++i) {
+            data[i] /= val;
+        }
         return *this;
     }
+};
 
-    inline friend bool operator<(const Value& lhs, const Value& rhs) {
-        return lhs.val < rhs.val;
+template<typename T>
+inline void extend_bounds(const std::valarray<T>& v, size_t& begin, size_t& end) {
+    begin = 0;
+    end = std::max(end, v.size());
+}
+template<typename T>
+inline void assign_zero(std::valarray<T>& v, size_t n, size_t begin, size_t end) {
+    v.resize(n, 0);
+}
+template<typename T>
+inline void add_scaled(std::valarray<T>& res, const T& factor, const std::valarray<T>& v) {
+    for (size_t i = 0; i < v.size(); ++i) {
+        res[i] += factor * v[i];
     }
-    inline friend bool operator<(const T& val, const Value& rhs) {
-        return val < rhs.val;
+}
+// Vector types may provide a version adding both in one pass
+template<typename T, typename Vector>
+inline void add_scaled(Vector& res, const T& a, const Vector& x, const T& b, const Vector& y) {
+    add_scaled(res, a, x);
+    add_scaled(res, b, y);
+}
+
+// Lazily evaluated expression on values, its derivative is only computed when assigned to a Value. As all operations are applied via the chain rule, this
+// derivative is a weighted sum of the derivatives of the values in the expression tree: the weights are computed along with the result, and the derivative of
+// every value is then added into the one result vector, without creating temporary derivative vectors for intermediate results.
+//
+// Values are only referenced in expressions, so expressions must not outlive the full-expression they are created in (use Value instead of auto).
+template<typename T, typename Vector, typename Derived>
+class Expression {
+  public:
+    inline const Derived& derived() const {
+        return static_cast<const Derived&>(*this);
+    }
+    inline T value() const {
+        return derived().value();
     }
-    inline friend bool operator<(const Value& lhs, const T& val) {
-        return lhs.val < val;
+    explicit inline operator T() const {
+        return derived().value();
     }
+};
 
-    inline friend bool operator<=(const Value& lhs, const Value& rhs) {
-        return lhs.val <= rhs.val;
+template<typename T, typename Vector, typename E>
+struct Stored {
+    using type = const E;
+};
+template<typename T, typename Vector>
+struct Stored<T, Vector, Value<T, Vector>> {
+    using type = const Value<T, Vector>&;
+};
+
+template<typename T, typename Vector, typename Operand>
+class UnaryExpression : public Expression<T, Vector, UnaryExpression<T, Vector, Operand>> {
+  protected:
+    typename Stored<T, Vector, Operand>::type operand;
+    const T val;
+    const T partial;
+
+  public:
+    UnaryExpression(const T& val_p, const Operand& operand_p, const T& partial_p) : operand(operand_p), val(val_p), partial(partial_p){};
+    inline T value() const {
+        return val;
+    }
+    inline size_t size() const {
+        return operand.size();
     }
-    inline friend bool operator<=(const T& val, const Value& rhs) {
-        return val <= rhs.val;
+    inline void bounds(size_t& begin, size_t& end) const {
+        if (partial != 0) {
+            operand.bounds(begin, end);
+        }
     }
-    inline friend bool operator<=(const Value& lhs, const T& val) {
-        return lhs.val <= val;
+    inline void accumulate(Vector& res, const T& weight) const {
+        if (partial != 0) {
+            operand.accumulate(res, weight * partial);
+        }
     }
+};
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline void accumulate_both(Vector& res, const Lhs& lhs, const T& lhs_weight, const Rhs& rhs, const T& rhs_weight) {
+    lhs.accumulate(res, lhs_weight);
+    rhs.accumulate(res, rhs_weight);
+}
+// Derivatives of two values, e.g. in a * x + b * y, are added in one go
+template<typename T, typename Vector>
+inline void accumulate_both(Vector& res, const Value<T, Vector>& lhs, const T& lhs_weight, const Value<T, Vector>& rhs, const T& rhs_weight) {
+    add_scaled(res, lhs_weight, lhs.derivative(), rhs_weight, rhs.derivative());
+}
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+class BinaryExpression : public Expression<T, Vector, BinaryExpression<T, Vector, Lhs, Rhs>> {
+  protected:
+    typename Stored<T, Vector, Lhs>::type lhs;
+    typename Stored<T, Vector, Rhs>::type rhs;
+    const T val;
+    const T lhs_partial;
+    const T rhs_partial;
 
-    inline friend bool operator>(const Value& lhs, const Value& rhs) {
-        return lhs.val > rhs.val;
+  public:
+    BinaryExpression(const T& val_p, const Lhs& lhs_p, const T& lhs_partial_p, const Rhs& rhs_p, const T& rhs_partial_p)
+        : lhs(lhs_p), rhs(rhs_p), val(val_p), lhs_partial(lhs_partial_p), rhs_partial(rhs_partial_p){};
+    inline T value() const {
+        return val;
     }
-    inline friend bool operator>(const T& val, const Value& rhs) {
-        return val > rhs.val;
+    inline size_t size() const {
+        return lhs.size();
     }
-    inline friend bool operator>(const Value& lhs, const T& val) {
-        return lhs.val > val;
+    inline void bounds(size_t& begin, size_t& end) const {
+        if (lhs_partial != 0) {
+            lhs.bounds(begin, end);
+        }
+        if (rhs_partial != 0) {
+            rhs.bounds(begin, end);
+        }
     }
+    inline void accumulate(Vector& res, const T& weight) const {
+        if (lhs_partial == 0) {
+            if (rhs_partial != 0) {
+                rhs.accumulate(res, weight * rhs_partial);
+            }
+        } else if (rhs_partial == 0) {
+            lhs.accumulate(res, weight * lhs_partial);
+        } else {
+            accumulate_both(res, lhs, weight * lhs_partial, rhs, weight * rhs_partial);
+        }
+    }
+};
 
-    inline friend bool operator>=(const Value& lhs, const Value& rhs) {
-        return lhs.val >= rhs.val;
+// Control variable as read via Variable::operator[]: its derivative has (at most) a single one at index, so it takes part in expressions by updating
+// only that entry, without derivative storage of its own
+template<typename T, typename Vector>
+class Seed : public Expression<T, Vector, Seed<T, Vector>> {
+  protected:
+    const T val;
+    const size_t index;
+    const size_t n;
+
+  public:
+    Seed(size_t n_p, const T& val_p) : val(val_p), index(n_p), n(n_p){};
+    Seed(size_t i, size_t n_p, const T& val_p) : val(val_p), index(i), n(n_p){};
+    inline T value() const {
+        return val;
     }
-    inline friend bool operator>=(const T& val, const Value& rhs) {
-        return val >= rhs.val;
+    inline size_t size() const {
+        return n;
     }
-    inline friend bool operator>=(const Value& lhs, const T& val) {
-        return lhs.val >= val;
+    inline void bounds(size_t& begin, size_t& end) const {
+        if (index < n) {
+            begin = std::min(begin, index);
+            end = std::max(end, index + 1);
+        }
     }
+    inline void accumulate(Vector& res, const T& weight) const {
+        if (index < n) {
+            res[index] += weight;
+        }
+    }
+};
 
-    inline friend bool operator==(const Value& lhs, const Value& rhs) {
-        return lhs.val == rhs.val;
+template<typename T, typename Vector>
+class Value : public Expression<T, Vector, Value<T, Vector>> {
+    friend class Variable<T, Vector>;
+    friend class SeededVariable<T, Vector>;
+
+  protected:
+    T val;
+    Vector dev;
+
+  public:
+    Value(size_t n, const T& val_p) : val(val_p), dev(0.0, n){};
+    Value(size_t i, size_t n, const T& val_p) : val(val_p), dev(0.0, n) {
+        dev[i] = 1;
+    }
+    // Evaluates the derivative of the whole expression in one go
+    template<typename Derived>
+    Value(const Expression<T, Vector, Derived>& e) : val(e.value()) {
+        const Derived& d = e.derived();
+        size_t begin = d.size();
+        size_t end = 0;
+        d.bounds(begin, end);
+        assign_zero(dev, d.size(), begin, end);
+        d.accumulate(dev, 1);
+    }
+    inline const T value() const {
+        return val;
     }
-    inline friend bool operator==(const T& val, const Value& rhs) {
-        return val == rhs.val;
+    explicit inline operator T() const {
+        return val;
     }
-    inline friend bool operator==(const Value& lhs, const T& val) {
-        return lhs.val == val;
+    inline const Vector& derivative() const {
+        return dev;
     }
 
-    inline friend bool operator!=(const Value& lhs, const Value& rhs) {
-        return lhs.val != rhs.val;
+    inline size_t size() const {
+        return dev.size();
+    }
+    inline void bounds(size_t& begin, size_t& end) const {
+        extend_bounds(dev, begin, end);
     }
-    inline friend bool operator!=(const T& val, const Value& rhs) {
-        return val != rhs.val;
+    inline void accumulate(Vector& res, const T& weight) const {
+        add_scaled(res, weight, dev);
     }
-    inline friend bool operator!=(const Value& lhs, const T& val) {
-        return lhs.val != val;
+
+    inline Value& operator+=(const Value& v) {
+        val += v.val;
+        dev += v.dev;
+        return *this;
+    }
+    inline Value& operator+=(const T& v) {
+        val += v;
+        return *this;
     }
 
-    friend Value std::pow<T, Vector>(const Value& lhs, const Value& rhs);
-    friend Value std::pow<T, Vector>(const T& val, const Value& rhs);
-    friend Value std::pow<T, Vector>(const Value& lhs, const T& val);
+    inline Value& operator-=(const Value& v) {
+        val -= v.val;
+        dev -= v.dev;
+        return *this;
+    }
+    inline Value& operator-=(const T& v) {
+        val -= v;
+        return *this;
+    }
 
-    friend Value std::log<T, Vector>(const Value& v);
-    friend Value std::log2<T, Vector>(const Value& v);
-    friend Value std::log10<T, Vector>(const Value& v);
-    friend Value std::exp<T, Vector>(const Value& v);
+    template<typename Derived>
+    inline Value& operator*=(const Expression<T, Vector, Derived>& e) {
+        return *this = *this * e;
+    }
+    inline Value& operator*=(const T& v) {
+        val *= v;
+        dev *= v;
+        return *this;
+    }
 
-    friend Value std::min<T, Vector>(const T& val, const Value& rhs);
-    friend Value std::min<T, Vector>(const Value& lhs, const T& val);
+    template<typename Derived>
+    inline Value& operator/=(const Expression<T, Vector, Derived>& e) {
+        return *this = *this / e;
+    }
+    inline Value& operator/=(const T& v) {
+        val /= v;
+        dev /= v;
+        return *this;
+    }
+};
 
-    friend Value std::max<T, Vector>(const T& val, const Value& rhs);
-    friend Value std::max<T, Vector>(const Value& lhs, const T& val);
+// Called by Variable::rewind before values are calculated anew, only needed for vectors allocated from the arena (to count per evaluation)
+template<typename Vector>
+struct Storage {
+    static inline void rewind() {}
+};
+template<typename T>
+struct Storage<RangeVector<T, ArenaAllocator<T>>> {
+    static inline void rewind() {
+        Arena::instance().reset_statistics();
+    }
 };
 
 template<typename T, typename Vector>
@@ -253,9 +734,18 @@ class Variable {
     std::vector<T> val;
     const size_t variables_num;
     const size_t variables_offset;
+    const size_t variables_stride;
 
   public:
-    Variable(size_t offset, size_t num, size_t length, const T& initial_value) : variables_num(num), variables_offset(offset), val(length, initial_value){};
+    // Element i is variable offset + i * stride of num variables (none if offset >= num), a stride > 1 interleaving several Variables
+    Variable(size_t offset, size_t num, size_t length, const T& initial_value, size_t stride = 1)
+        : val(length, initial_value), variables_num(num), variables_offset(offset), variables_stride(stride){};
+    // Values calculated before a rewind keep their derivatives, so only those depending on changed variables need to be calculated anew
+    static const bool incremental = true;
+    // Nothing is recorded in forward mode, only starts counting the derivative storage of the next evaluation
+    static inline void rewind(size_t /* variables_num */) {
+        Storage<Vector>::rewind();
+    }
     inline const Variable& operator=(const std::vector<T>& val_p) {
         val.assign(val_p);
         return *this;
@@ -266,89 +756,294 @@ class Variable {
     inline std::vector<T>& value() {
         return val;
     }
-    inline Value<T, Vector> operator[](size_t i) const {
+    inline Seed<T, Vector> operator[](size_t i) const {
         if (variables_offset < variables_num) {
-            return {i + variables_offset, variables_num, val[i]};
+            return {variables_offset + i * variables_stride, variables_num, val[i]};
         } else {
             return {variables_num, val[i]};
         }
     }
-    inline Value<T, Vector> at(size_t i) const {
+    inline Seed<T, Vector> at(size_t i) const {
         if (variables_offset < variables_num) {
-            return {i + variables_offset, variables_num, val.at(i)};
+            return {variables_offset + i * variables_stride, variables_num, val.at(i)};
         } else {
             return {variables_num, val.at(i)};
         }
     }
 };
+
+// Variable seeded with user-chosen directions instead of unit vectors, derivative entry j of a result then holds its derivative along direction j
+// (Jacobian-vector products). With a sparse Vector like RangeVector, only these first entries are stored, so the cost grows with the number of
+// directions rather than the number of variables.
+template<typename T, typename Vector>
+class SeededVariable : public Variable<T, Vector> {
+  protected:
+    using Variable<T, Vector>::val;
+    using Variable<T, Vector>::variables_num;
+    using Variable<T, Vector>::variables_offset;
+    using Variable<T, Vector>::variables_stride;
+    std::vector<T> seeds;  // seeds[i * directions_num + j] is entry i of direction j
+    size_t directions_num = 0;
+    size_t seeded_num = 0;
+
+    inline Value<T, Vector> seeded(size_t i, const T& val_p) const {
+        Value<T, Vector> res{variables_num, val_p};
+        if (variables_offset < variables_num && i < seeded_num) {
+            const T* seed = &seeds[i * directions_num];
+            for (size_t j = 0; j < directions_num; ++j) {
+                if (seed[j] != 0) {
+                    res.dev[j] = seed[j];
+                }
+            }
+        }
+        return res;
+    }
+
+  public:
+    using Variable<T, Vector>::Variable;
+    // Derivatives depend on the seeds, which are not tracked
+    static const bool incremental = false;
+    // Takes directions_num_p directions (at most variables_num) over the first length variables each, one after the other, and seeds each element
+    // with the entries of its variable; elements whose variable is beyond length are seeded with zero
+    void seed(const T* directions, size_t directions_num_p, size_t length) {
+        directions_num = directions_num_p;
+        seeded_num = 0;
+        while (seeded_num < val.size() && variables_offset + seeded_num * variables_stride < length) {
+            ++seeded_num;
+        }
+        seeds.resize(seeded_num * directions_num);
+        for (size_t j = 0; j < directions_num; ++j) {
+            for (size_t i = 0; i < seeded_num; ++i) {
+                seeds[i * directions_num + j] = directions[j * length + variables_offset + i * variables_stride];
+            }
+        }
+    }
+    inline Value<T, Vector> operator[](size_t i) const {
+        return seeded(i, val[i]);
+    }
+    inline Value<T, Vector> at(size_t i) const {
+        return seeded(i, val.at(i));
+    }
+};
+
+template<typename T, typename Vector, typename E>
+inline UnaryExpression<T, Vector, E> operator-(const Expression<T, Vector, E>& v) {
+    return {-v.value(), v.derived(), -1};
+}
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline BinaryExpression<T, Vector, Lhs, Rhs> operator+(const Expression<T, Vector, Lhs>& lhs, const Expression<T, Vector, Rhs>& rhs) {
+    return {lhs.value() + rhs.value(), lhs.derived(), 1, rhs.derived(), 1};
+}
+template<typename T, typename Vector, typename Rhs>
+inline UnaryExpression<T, Vector, Rhs> operator+(const typename Identity<T>::type& val, const Expression<T, Vector, Rhs>& rhs) {
+    return {val + rhs.value(), rhs.derived(), 1};
+}
+template<typename T, typename Vector, typename Lhs>
+inline UnaryExpression<T, Vector, Lhs> operator+(const Expression<T, Vector, Lhs>& lhs, const typename Identity<T>::type& val) {
+    return {lhs.value() + val, lhs.derived(), 1};
+}
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline BinaryExpression<T, Vector, Lhs, Rhs> operator-(const Expression<T, Vector, Lhs>& lhs, const Expression<T, Vector, Rhs>& rhs) {
+    return {lhs.value() - rhs.value(), lhs.derived(), 1, rhs.derived(), -1};
+}
+template<typename T, typename Vector, typename Rhs>
+inline UnaryExpression<T, Vector, Rhs> operator-(const typename Identity<T>::type& val, const Expression<T, Vector, Rhs>& rhs) {
+    return {val - rhs.value(), rhs.derived(), -1};
+}
+template<typename T, typename Vector, typename Lhs>
+inline UnaryExpression<T, Vector, Lhs> operator-(const Expression<T, Vector, Lhs>& lhs, const typename Identity<T>::type& val) {
+    return {lhs.value() - val, lhs.derived(), 1};
+}
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline BinaryExpression<T, Vector, Lhs, Rhs> operator*(const Expression<T, Vector, Lhs>& lhs, const Expression<T, Vector, Rhs>& rhs) {
+    return {lhs.value() * rhs.value(), lhs.derived(), rhs.value(), rhs.derived(), lhs.value()};
+}
+template<typename T, typename Vector, typename Rhs>
+inline UnaryExpression<T, Vector, Rhs> operator*(const typename Identity<T>::type& val, const Expression<T, Vector, Rhs>& rhs) {
+    return {val * rhs.value(), rhs.derived(), val};
+}
+template<typename T, typename Vector, typename Lhs>
+inline UnaryExpression<T, Vector, Lhs> operator*(const Expression<T, Vector, Lhs>& lhs, const typename Identity<T>::type& val) {
+    return {lhs.value() * val, lhs.derived(), val};
+}
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline BinaryExpression<T, Vector, Lhs, Rhs> operator/(const Expression<T, Vector, Lhs>& lhs, const Expression<T, Vector, Rhs>& rhs) {
+    return {lhs.value() / rhs.value(), lhs.derived(), 1 / rhs.value(), rhs.derived(), -lhs.value() / rhs.value() / rhs.value()};
+}
+template<typename T, typename Vector, typename Rhs>
+inline UnaryExpression<T, Vector, Rhs> operator/(const typename Identity<T>::type& val, const Expression<T, Vector, Rhs>& rhs) {
+    return {val / rhs.value(), rhs.derived(), -val / rhs.value() / rhs.value()};
+}
+template<typename T, typename Vector, typename Lhs>
+inline UnaryExpression<T, Vector, Lhs> operator/(const Expression<T, Vector, Lhs>& lhs, const typename Identity<T>::type& val) {
+    return {lhs.value() / val, lhs.derived(), 1 / val};
+}
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline bool operator<(const Expression<T, Vector, Lhs>& lhs, const Expression<T, Vector, Rhs>& rhs) {
+    return lhs.value() < rhs.value();
+}
+template<typename T, typename Vector, typename Rhs>
+inline bool operator<(const typename Identity<T>::type& val, const Expression<T, Vector, Rhs>& rhs) {
+    return val < rhs.value();
+}
+template<typename T, typename Vector, typename Lhs>
+inline bool operator<(const Expression<T, Vector, Lhs>& lhs, const typename Identity<T>::type& val) {
+    return lhs.value() < val;
+}
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline bool operator<=(const Expression<T, Vector, Lhs>& lhs, const Expression<T, Vector, Rhs>& rhs) {
+    return lhs.value() <= rhs.value();
+}
+template<typename T, typename Vector, typename Rhs>
+inline bool operator<=(const typename Identity<T>::type& val, const Expression<T, Vector, Rhs>& rhs) {
+    return val <= rhs.value();
+}
+template<typename T, typename Vector, typename Lhs>
+inline bool operator<=(const Expression<T, Vector, Lhs>& lhs, const typename Identity<T>::type& val) {
+    return lhs.value() <= val;
+}
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline bool operator>(const Expression<T, Vector, Lhs>& lhs, const Expression<T, Vector, Rhs>& rhs) {
+    return lhs.value() > rhs.value();
+}
+template<typename T, typename Vector, typename Rhs>
+inline bool operator>(const typename Identity<T>::type& val, const Expression<T, Vector, Rhs>& rhs) {
+    return val > rhs.value();
+}
+template<typename T, typename Vector, typename Lhs>
+inline bool operator>(const Expression<T, Vector, Lhs>& lhs, const typename Identity<T>::type& val) {
+    return lhs.value() > val;
+}
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline bool operator>=(const Expression<T, Vector, Lhs>& lhs, const Expression<T, Vector, Rhs>& rhs) {
+    return lhs.value() >= rhs.value();
+}
+template<typename T, typename Vector, typename Rhs>
+inline bool operator>=(const typename Identity<T>::type& val, const Expression<T, Vector, Rhs>& rhs) {
+    return val >= rhs.value();
+}
+template<typename T, typename Vector, typename Lhs>
+inline bool operator>=(const Expression<T, Vector, Lhs>& lhs, const typename Identity<T>::type& val) {
+    return lhs.value() >= val;
+}
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline bool operator==(const Expression<T, Vector, Lhs>& lhs, const Expression<T, Vector, Rhs>& rhs) {
+    return lhs.value() == rhs.value();
+}
+template<typename T, typename Vector, typename Rhs>
+inline bool operator==(const typename Identity<T>::type& val, const Expression<T, Vector, Rhs>& rhs) {
+    return val == rhs.value();
+}
+template<typename T, typename Vector, typename Lhs>
+inline bool operator==(const Expression<T, Vector, Lhs>& lhs, const typename Identity<T>::type& val) {
+    return lhs.value() == val;
+}
+
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline bool operator!=(const Expression<T, Vector, Lhs>& lhs, const Expression<T, Vector, Rhs>& rhs) {
+    return lhs.value() != rhs.value();
+}
+template<typename T, typename Vector, typename Rhs>
+inline bool operator!=(const typename Identity<T>::type& val, const Expression<T, Vector, Rhs>& rhs) {
+    return val != rhs.value();
+}
+template<typename T, typename Vector, typename Lhs>
+inline bool operator!=(const Expression<T, Vector, Lhs>& lhs, const typename Identity<T>::type& val) {
+    return lhs.value() != val;
+}
 }
 
 namespace std {
 
-template<typename T, typename Vector>
-inline autodiff::Value<T, Vector> pow(const autodiff::Value<T, Vector>& lhs, const autodiff::Value<T, Vector>& rhs) {
-    const T p = pow(lhs.val, rhs.val);
-    return {p, rhs.dev * (log(lhs.val) * p) + lhs.dev * (p * rhs.val / lhs.val)};
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline autodiff::BinaryExpression<T, Vector, Lhs, Rhs> pow(const autodiff::Expression<T, Vector, Lhs>& lhs, const autodiff::Expression<T, Vector, Rhs>& rhs) {
+    const T p = pow(lhs.value(), rhs.value());
+    return {p, lhs.derived(), p * rhs.value() / lhs.value(), rhs.derived(), log(lhs.value()) * p};
 }
-template<typename T, typename Vector>
-inline autodiff::Value<T, Vector> pow(const T& val, const autodiff::Value<T, Vector>& rhs) {
-    const T p = pow(val, rhs.val);
-    return {p, rhs.dev * (p * log(val))};
+template<typename T, typename Vector, typename Rhs>
+inline autodiff::UnaryExpression<T, Vector, Rhs> pow(const typename autodiff::Identity<T>::type& val, const autodiff::Expression<T, Vector, Rhs>& rhs) {
+    const T p = pow(val, rhs.value());
+    return {p, rhs.derived(), p * log(val)};
 }
-template<typename T, typename Vector>
-inline autodiff::Value<T, Vector> pow(const autodiff::Value<T, Vector>& lhs, const T& val) {
-    return {pow(lhs.val, val), lhs.dev * (val * pow(lhs.val, val - 1))};
+template<typename T, typename Vector, typename Lhs>
+inline autodiff::UnaryExpression<T, Vector, Lhs> pow(const autodiff::Expression<T, Vector, Lhs>& lhs, const typename autodiff::Identity<T>::type& val) {
+    return {pow(lhs.value(), val), lhs.derived(), val * pow(lhs.value(), val - 1)};
 }
 
-template<typename T, typename Vector>
-inline autodiff::Value<T, Vector> log(const autodiff::Value<T, Vector>& v) {
-    return {log(v.val), v.dev / v.val};
+template<typename T, typename Vector, typename E>
+inline autodiff::UnaryExpression<T, Vector, E> log(const autodiff::Expression<T, Vector, E>& v) {
+    return {log(v.value()), v.derived(), 1 / v.value()};
 }
-template<typename T, typename Vector>
-inline autodiff::Value<T, Vector> log2(const autodiff::Value<T, Vector>& v) {
-    return {log2(v.val), v.dev / (v.val * M_LN2)};
+template<typename T, typename Vector, typename E>
+inline autodiff::UnaryExpression<T, Vector, E> log2(const autodiff::Expression<T, Vector, E>& v) {
+    return {log2(v.value()), v.derived(), 1 / (v.value() * M_LN2)};
 }
-template<typename T, typename Vector>
-inline autodiff::Value<T, Vector> log10(const autodiff::Value<T, Vector>& v) {
-    return {log10(v.val), v.dev / (v.val * M_LN10)};
+template<typename T, typename Vector, typename E>
+inline autodiff::UnaryExpression<T, Vector, E> log10(const autodiff::Expression<T, Vector, E>& v) {
+    return {log10(v.value()), v.derived(), 1 / (v.value() * M_LN10)};
 }
-template<typename T, typename Vector>
-inline autodiff::Value<T, Vector> exp(const autodiff::Value<T, Vector>& v) {
-    const T e = exp(v.val);
-    return {e, v.dev * e};
+template<typename T, typename Vector, typename E>
+inline autodiff::UnaryExpression<T, Vector, E> exp(const autodiff::Expression<T, Vector, E>& v) {
+    const T e = exp(v.value());
+    return {e, v.derived(), e};
 }
 
-template<typename T, typename Vector>
-inline autodiff::Value<T, Vector> min(const T& val, const autodiff::Value<T, Vector>& rhs) {
-    if (val < rhs.val) {
-        return {rhs.dev.size(), val};
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline autodiff::BinaryExpression<T, Vector, Lhs, Rhs> min(const autodiff::Expression<T, Vector, Lhs>& lhs, const autodiff::Expression<T, Vector, Rhs>& rhs) {
+    if (lhs.value() < rhs.value()) {
+        return {lhs.value(), lhs.derived(), 1, rhs.derived(), 0};
     } else {
-        return rhs;
+        return {rhs.value(), lhs.derived(), 0, rhs.derived(), 1};
     }
 }
-template<typename T, typename Vector>
-inline autodiff::Value<T, Vector> min(const autodiff::Value<T, Vector>& lhs, const T& val) {
-    if (lhs.val < val) {
-        return lhs;
+template<typename T, typename Vector, typename Rhs>
+inline autodiff::UnaryExpression<T, Vector, Rhs> min(const typename autodiff::Identity<T>::type& val, const autodiff::Expression<T, Vector, Rhs>& rhs) {
+    if (val < rhs.value()) {
+        return {val, rhs.derived(), 0};
     } else {
-        return {lhs.dev.size(), val};
+        return {rhs.value(), rhs.derived(), 1};
+    }
+}
+template<typename T, typename Vector, typename Lhs>
+inline autodiff::UnaryExpression<T, Vector, Lhs> min(const autodiff::Expression<T, Vector, Lhs>& lhs, const typename autodiff::Identity<T>::type& val) {
+    if (lhs.value() < val) {
+        return {lhs.value(), lhs.derived(), 1};
+    } else {
+        return {val, lhs.derived(), 0};
     }
 }
 
-template<typename T, typename Vector>
-inline autodiff::Value<T, Vector> max(const T& val, const autodiff::Value<T, Vector>& rhs) {
-    if (val < rhs.val) {
-        return rhs;
+template<typename T, typename Vector, typename Lhs, typename Rhs>
+inline autodiff::BinaryExpression<T, Vector, Lhs, Rhs> max(const autodiff::Expression<T, Vector, Lhs>& lhs, const autodiff::Expression<T, Vector, Rhs>& rhs) {
+    if (lhs.value() < rhs.value()) {
+        return {rhs.value(), lhs.derived(), 0, rhs.derived(), 1};
     } else {
-        return {rhs.dev.size(), val};
+        return {lhs.value(), lhs.derived(), 1, rhs.derived(), 0};
     }
 }
-template<typename T, typename Vector>
-inline autodiff::Value<T, Vector> max(const autodiff::Value<T, Vector>& lhs, const T& val) {
-    if (lhs.val < val) {
-        return {lhs.dev.size(), val};
+template<typename T, typename Vector, typename Rhs>
+inline autodiff::UnaryExpression<T, Vector, Rhs> max(const typename autodiff::Identity<T>::type& val, const autodiff::Expression<T, Vector, Rhs>& rhs) {
+    if (val < rhs.value()) {
+        return {rhs.value(), rhs.derived(), 1};
+    } else {
+        return {val, rhs.derived(), 0};
+    }
+}
+template<typename T, typename Vector, typename Lhs>
+inline autodiff::UnaryExpression<T, Vector, Lhs> max(const autodiff::Expression<T, Vector, Lhs>& lhs, const typename autodiff::Identity<T>::type& val) {
+    if (lhs.value() < val) {
+        return {val, lhs.derived(), 0};
     } else {
-        return lhs;
+        return {lhs.value(), lhs.derived(), 1};
     }
 }
 }
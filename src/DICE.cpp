@@ -18,14 +18,16 @@
 */
 
 #include "DICE.h"
+#include <algorithm>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <numeric>
 #include <sstream>
 #include <stdexcept>
 #include <string>
-#include "DICEClimate.h"
-#include "DICEDamage.h"
+#include <thread>
+#include <tuple>
 #include "Optimization.h"
 #include "csv-parser.h"
 #include "settingsnode.h"
@@ -42,52 +44,30 @@ template<typename Value, typename Time>
 DICE<Value, Time>::DICE(const settings::SettingsNode& settings_p)
     : settings(settings_p),
       global(settings_p["parameters"]),
-      control(settings_p["parameters"]["timestep_num"].as<Time>()),
-      emissions(global, control, economies) {
+      model(settings_p, global) {
 }
 
 template<typename Value, typename Time>
 void DICE<Value, Time>::initialize() {
     std::cout << std::setprecision(13);
 
-    // Initialize climate module
-    {
-        const settings::SettingsNode& climate_node = settings["climate"];
-        const std::string& type = climate_node["type"].as<std::string>();
-        if (type == "dice") {
-            climate.reset(new climate::DICEClimate<autodiff::Value<Value>, Time, Value, autodiff::Variable<Value>>(climate_node["parameters"], global, control,
-                                                                                                                   emissions));
-        } else {
-            throw std::runtime_error("unknown climate module type '" + type + "'");
-        }
-        climate->initialize();
-    }
+    // The models created for the runs refer to the DICE climate and damage modules directly if these are the ones configured
+    dice_modules = settings["climate"]["type"].as<std::string>() == "dice" && settings["damage"]["type"].as<std::string>() == "dice";
 
-    // Initialize damage module
-    {
-        const settings::SettingsNode& damage_node = settings["damage"];
-        const std::string& type = damage_node["type"].as<std::string>();
-        if (type == "dice") {
-            damage.reset(new damage::DICEDamage<autodiff::Value<Value>, Time, Value, autodiff::Variable<Value>>(damage_node["parameters"], global, *climate));
-        } else {
-            throw std::runtime_error("unknown damage module type '" + type + "'");
-        }
-        damage->initialize();
-    }
+    model.initialize();
 
-    // Initialize regions
-    {
-        for (const auto&& region_node : settings["regions"].as_sequence()) {
-            economies.emplace_back(
-                Economy<autodiff::Value<Value>, Time, Value, autodiff::Variable<Value>>(region_node["economy"], global, control, *climate, *damage));
+    if (settings.has("equations")) {
+        const std::string& filename = settings["equations"].as<std::string>();
+        std::ofstream file(filename);
+        if (!file) {
+            throw std::runtime_error("could not open '" + filename + "'");
         }
+        model.equations().dump(file);
     }
 
-    emissions.initialize();
-
     // Initialize control variables
     if (settings.has("control")) {
-        class ControlInputObserver : public Observer<autodiff::Value<Value>, Time, Value> {
+        class ControlInputObserver : public Observer<ForwardValue, Time, Value> {
           protected:
             const settings::SettingsNode& input_node;
 
@@ -129,28 +109,172 @@ void DICE<Value, Time>::initialize() {
         };
         const settings::SettingsNode& input_node = settings["control"];
         ControlInputObserver observer(input_node);
-        control.observe(observer);
+        model.control.observe(observer);
+        // Values calculated during initialization (e.g. the first emissions) depend on the control variables
+        model.reset();
+    }
+}
+
+// Instantiation of model type M for the configured modules: composed at compile time for the DICE modules, through their virtual interfaces
+// otherwise
+template<typename Value, typename Time>
+template<template<typename, typename, typename, typename, template<typename, typename, typename, typename> class> class M,
+         typename V,
+         typename Variable,
+         typename... Args>
+std::unique_ptr<ModelBase<Value, Time>> DICE<Value, Time>::create_model(Args... args) {
+    std::unique_ptr<ModelBase<Value, Time>> res;
+    if (dice_modules) {
+        res.reset(new M<V, Time, Value, Variable, DICEModules>(settings, global, args...));
+    } else {
+        res.reset(new M<V, Time, Value, Variable, DynamicModules>(settings, global, args...));
+    }
+    res->initialize();
+    return res;
+}
+
+template<typename Value, typename Time>
+std::unique_ptr<ModelBase<Value, Time>> DICE<Value, Time>::create_optimization_model(const settings::SettingsNode& optimization_node) {
+    const std::string& derivatives = optimization_node["derivatives"].as<std::string>("reverse");
+    if (derivatives == "forward") {
+        // Dense derivatives of fixed length for the common numbers of model variables (timesteps, or twice as many with interleaved mu variables)
+        switch (model.control.variables_num) {
+            case 60:
+                return create_model<Model, FixedForwardValue<60>, FixedForwardVariable<60>>();
+            case 100:
+                return create_model<Model, FixedForwardValue<100>, FixedForwardVariable<100>>();
+            default:
+                return create_model<Model, ForwardValue, ForwardVariable>();
+        }
+    } else if (derivatives == "reverse") {
+        return create_reverse_model(optimization_node["checkpoints"].as<bool>(false));
+    }
+    throw std::runtime_error("unknown derivatives '" + derivatives + "'");
+}
+
+// Bounds the tape to single timesteps if checkpointed, storing the states of all timesteps without derivatives instead (for the memory needed
+// otherwise by long horizons)
+template<typename Value, typename Time>
+std::unique_ptr<ModelBase<Value, Time>> DICE<Value, Time>::create_reverse_model(bool checkpointed) {
+    if (checkpointed) {
+        return create_model<CheckpointedModel, autodiff::reverse::Value<Value>, autodiff::reverse::Variable<Value>>();
+    }
+    return create_model<Model, autodiff::reverse::Value<Value>, autodiff::reverse::Variable<Value>>();
+}
+
+// Model without derivatives for evaluations where no gradient is needed
+template<typename Value, typename Time>
+std::unique_ptr<ModelBase<Value, Time>> DICE<Value, Time>::create_value_model() {
+    return create_model<Model, Value, PlainVariable<Value>>();
+}
+
+// Model for Hessian-vector products by forward-over-reverse differentiation, i.e. tangents along the direction propagated through the tape
+template<typename Value, typename Time>
+std::unique_ptr<ModelBase<Value, Time>> DICE<Value, Time>::create_hessian_model() {
+    return create_model<SecondOrderModel, autodiff::reverse::Value<autodiff::reverse::Dual<Value>>, autodiff::reverse::DualVariable<Value>>();
+}
+
+// Model for derivatives along given directions (forward mode seeded with these instead of unit vectors)
+template<typename Value, typename Time>
+std::unique_ptr<ModelBase<Value, Time>> DICE<Value, Time>::create_directional_model() {
+    return create_model<DirectionalModel, ForwardValue, autodiff::SeededVariable<Value, ForwardVector>>();
+}
+
+// Starting points for a multistart, either a Latin hypercube sample over the bounds of the variables ("lhs") or random perturbations of the
+// saving rate optlrsav (and the current emission control rates, "optlrsav") or of the current values ("previous"), the first of which is unperturbed
+template<typename Value, typename Time>
+std::vector<TimeSeries<Value>> DICE<Value, Time>::create_starts(const Optimization<Value, Time>& optimization,
+                                                                const settings::SettingsNode& iteration_node,
+                                                                const TimeSeries<Value>& initial_values,
+                                                                Time s_num,
+                                                                std::mt19937& random) {
+    const size_t starts_num = iteration_node["multistart"].as<size_t>();
+    const std::string& type = iteration_node["starts"].as<std::string>("lhs");
+    std::uniform_real_distribution<Value> uniform(0, 1);
+    std::vector<TimeSeries<Value>> starts(starts_num, initial_values);
+    if (type == "lhs") {
+        // Each variable takes a value from each of starts_num equally sized strata of its range, the strata being permuted independently
+        std::vector<size_t> strata(starts_num);
+        for (size_t i = 0; i < initial_values.size(); ++i) {
+            std::iota(std::begin(strata), std::end(strata), 0);
+            std::shuffle(std::begin(strata), std::end(strata), random);
+            const Value lower = optimization.lower_bounds[i];
+            const Value upper = optimization.upper_bounds[i];
+            for (size_t k = 0; k < starts_num; ++k) {
+                starts[k][i] = lower + (upper - lower) * (strata[k] + uniform(random)) / starts_num;
+            }
+        }
+    } else if (type == "optlrsav" || type == "previous") {
+        const Value perturbation = iteration_node["perturbation"].as<Value>(0.1);
+        for (size_t k = 0; k < starts_num; ++k) {
+            if (type == "optlrsav") {
+                std::fill(std::begin(starts[k]), std::begin(starts[k]) + s_num, global.optlrsav);
+            }
+            for (size_t i = 0; i < initial_values.size(); ++i) {
+                if (k > 0) {
+                    starts[k][i] += perturbation * (2 * uniform(random) - 1);
+                }
+                starts[k][i] = std::min(std::max(starts[k][i], optimization.lower_bounds[i]), optimization.upper_bounds[i]);
+            }
+        }
+    } else {
+        throw std::runtime_error("unknown starts '" + type + "'");
     }
+    return starts;
 }
 
 template<typename Value, typename Time>
 void DICE<Value, Time>::single_optimization(Optimization<Value, Time>& optimization,
+                                            ModelBase<Value, Time>& optimization_model,
+                                            const std::vector<ModelBase<Value, Time>*>& auxiliary_models,
                                             const settings::SettingsNode& optimization_node,
                                             TimeSeries<Value>& initial_values,
+                                            Time s_num,
+                                            Time mu_first,
                                             bool verbose) {
     for (const auto& iteration_node : optimization_node["iterations"].as_sequence()) {
+        // Multistart: local optimizations from several starting points at once, keeping the best feasible solution
+        const bool multistart = iteration_node.has("multistart");
+        std::mt19937 random(iteration_node["seed"].as<unsigned>(std::random_device{}()));
+        const size_t threads = iteration_node["threads"].as<size_t>(std::max(1u, std::thread::hardware_concurrency()));
         for (size_t i = 0; i < iteration_node["repeat"].as<size_t>(1); ++i) {
-            std::copy(std::begin(control.s.value()), std::begin(control.s.value()) + initial_values.size(), std::begin(initial_values));
-            optimization.optimize(iteration_node, initial_values, verbose);
+            std::copy(std::begin(model.control.s.value()), std::begin(model.control.s.value()) + s_num, std::begin(initial_values));
+            std::copy(std::begin(model.control.mu.value()) + mu_first,
+                      std::begin(model.control.mu.value()) + mu_first + (initial_values.size() - s_num),
+                      std::begin(initial_values) + s_num);
+            for (size_t i = 0; i < initial_values.size(); ++i) {
+                initial_values[i] = std::min(std::max(initial_values[i], optimization.lower_bounds[i]), optimization.upper_bounds[i]);
+            }
+            optimization_model.mu() = model.control.mu.value();
+            optimization_model.s() = model.control.s.value();
+            for (auto&& auxiliary_model : auxiliary_models) {
+                auxiliary_model->mu() = model.control.mu.value();
+                auxiliary_model->s() = model.control.s.value();
+            }
+            if (multistart) {
+                std::vector<TimeSeries<Value>> starts = create_starts(optimization, iteration_node, initial_values, s_num, random);
+                initial_values = starts[optimization.multistart(iteration_node, starts, threads, verbose)];
+            } else {
+                optimization.optimize(iteration_node, initial_values, verbose);
+            }
+            model.control.s.value() = optimization_model.s();
+            model.control.mu.value() = optimization_model.mu();
+            reset();
             if (verbose) {
-                reset();
-                const autodiff::Value<Value> utility = calc_single_utility();
+                const ForwardValue utility = model.calc_single_utility();
+                const auto& derivative = utility.derivative();
                 Value sum = 0;
-                for (size_t i = 0; i < initial_values.size(); ++i) {
-                    sum += utility.derivative()[i] * utility.derivative()[i];
+                for (Time t = 0; t < s_num; ++t) {
+                    sum += derivative[model.control.s_index(t)] * derivative[model.control.s_index(t)];
+                }
+                for (Time t = mu_first; t < mu_first + initial_values.size() - s_num; ++t) {
+                    sum += derivative[model.control.mu_index(t)] * derivative[model.control.mu_index(t)];
                 }
                 std::cout << "Gradient length = " << std::sqrt(sum) << std::endl;
                 std::cout << "Finished with utility = " << utility.value() << std::endl;
+                const autodiff::Arena& arena = autodiff::Arena::instance();
+                std::cout << "Derivative storage per evaluation = " << arena.allocations << " allocations, " << arena.bytes << " bytes, "
+                          << arena.heap_allocations << " from heap" << std::endl;
             }
         }
     }
@@ -158,34 +282,123 @@ void DICE<Value, Time>::single_optimization(Optimization<Value, Time>& optimizat
 
 template<typename Value, typename Time>
 void DICE<Value, Time>::run() {
-    if (economies.size() == 0) {
+    if (model.economies.size() == 0) {
         throw std::runtime_error("no economies given");
     }
-    if (economies.size() == 1) {
+    if (model.economies.size() == 1) {
         const settings::SettingsNode& optimization_node = settings["optimization"];
         if (optimization_node.has("iterations")) {
             class DICEOptimization : public Optimization<Value, Time> {
               protected:
-                DICE& dice;
+                ModelBase<Value, Time>& model;
+                ModelBase<Value, Time>& value_model;
+                ModelBase<Value, Time>* hessian_model;
+                ModelBase<Value, Time>* directional_model;
+                const std::vector<size_t> indices;  // Indices of the optimization variables among all variables of the models (e.g. in derivatives)
+                const size_t model_variables_num;
+                const bool clonable;
+                std::vector<std::unique_ptr<ModelBase<Value, Time>>> owned_models;  // Models cloned for this instance
+
+                // Utility and constraint at the variables evaluated last: optimizers ask for both at the same variables, so they are calculated
+                // together in one pass
+                std::vector<Value> cached_vars;
+                bool cached_grads = false;
+                bool cached_with_constraint = false;
+                Value cached_utility = 0;
+                Value cached_constraint = 0;
+                std::vector<Value> cached_utility_grad;  // over all variables of the models
+                std::vector<Value> cached_constraint_grad;
+
+                void set_variables(ModelBase<Value, Time>& m, const Value* vars) const {
+                    std::copy(vars, vars + s_num, std::begin(m.s()));
+                    std::copy(vars + s_num, vars + variables_num, std::begin(m.mu()) + mu_first);
+                }
+
+                // Entries of the optimization variables in v (num vectors over them, one after the other) placed among all variables of the models
+                std::vector<Value> scatter(const Value* v, size_t num) const {
+                    std::vector<Value> res(num * model_variables_num, 0);
+                    for (size_t j = 0; j < num; ++j) {
+                        for (size_t i = 0; i < variables_num; ++i) {
+                            res[j * model_variables_num + indices[i]] = v[j * variables_num + i];
+                        }
+                    }
+                    return res;
+                }
+
+                void gather(const Value* v, Value* out) const {
+                    for (size_t i = 0; i < variables_num; ++i) {
+                        out[i] = v[indices[i]];
+                    }
+                }
+
+                // Calls without gradient are evaluated without derivatives. The variables are always kept in model, whose s() and mu() are read
+                // back after the optimization
+                void evaluate(const Value* vars, bool grads, bool with_constraint) {
+                    set_variables(model, vars);
+                    if ((cached_grads || !grads) && (cached_with_constraint || !with_constraint) && cached_vars.size() == variables_num
+                        && std::equal(vars, vars + variables_num, std::begin(cached_vars))) {
+                        return;
+                    }
+                    ModelBase<Value, Time>* m = &model;
+                    if (grads) {
+                        model.reset();
+                    } else {
+                        set_variables(value_model, vars);
+                        value_model.reset();
+                        m = &value_model;
+                    }
+                    Value* utility_grad = grads ? &cached_utility_grad[0] : nullptr;
+                    if (with_constraint) {
+                        std::tie(cached_utility, cached_constraint) =
+                            m->utility_and_cca_constraint(utility_grad, grads ? &cached_constraint_grad[0] : nullptr, model_variables_num);
+                    } else {
+                        cached_utility = m->utility(utility_grad, model_variables_num);
+                    }
+                    cached_vars.assign(vars, vars + variables_num);
+                    cached_grads = grads;
+                    cached_with_constraint = with_constraint;
+                }
 
               public:
                 using Optimization<Value, Time>::variables_num;
                 using Optimization<Value, Time>::objectives_num;
                 using Optimization<Value, Time>::constraints_num;
-                DICEOptimization(size_t variables_num_p, size_t objectives_num_p, size_t constraints_num_p, DICE& dice_p)
-                    : Optimization<Value, Time>(variables_num_p, objectives_num_p, constraints_num_p), dice(dice_p){};
+                // Optimization variables are s up to s_num and, if optimized, mu from mu_first on
+                const size_t s_num;
+                const Time mu_first;
+                DICEOptimization(size_t s_num_p,
+                                 Time mu_first_p,
+                                 std::vector<size_t> indices_p,
+                                 size_t model_variables_num_p,
+                                 size_t objectives_num_p,
+                                 size_t constraints_num_p,
+                                 bool clonable_p,
+                                 ModelBase<Value, Time>& model_p,
+                                 ModelBase<Value, Time>& value_model_p,
+                                 ModelBase<Value, Time>* hessian_model_p,
+                                 ModelBase<Value, Time>* directional_model_p)
+                    : Optimization<Value, Time>(indices_p.size(), objectives_num_p, constraints_num_p),
+                      model(model_p),
+                      value_model(value_model_p),
+                      hessian_model(hessian_model_p),
+                      directional_model(directional_model_p),
+                      indices(std::move(indices_p)),
+                      model_variables_num(model_variables_num_p),
+                      clonable(clonable_p),
+                      cached_utility_grad(model_variables_num_p),
+                      cached_constraint_grad(model_variables_num_p),
+                      s_num(s_num_p),
+                      mu_first(mu_first_p){};
 
                 std::vector<Value> objective(const Value* vars, Value* grad) override {
 #ifdef DEBUG
                     try {
 #endif
-                        std::copy(vars, vars + variables_num, std::begin(dice.control.s.value()));
-                        dice.reset();
-                        const autodiff::Value<Value> utility = dice.calc_single_utility();
+                        evaluate(vars, grad != nullptr, constraints_num > 0);
                         if (grad) {
-                            std::copy(&utility.derivative()[0], &utility.derivative()[variables_num], grad);
+                            gather(&cached_utility_grad[0], grad);
                         }
-                        return {utility.value()};
+                        return {cached_utility};
 #ifdef DEBUG
                     } catch (std::exception& e) {
                         std::cerr << "Exception '" << e.what() << "' in optimization" << std::endl;
@@ -198,13 +411,11 @@ void DICE<Value, Time>::run() {
 #ifdef DEBUG
                     try {
 #endif
-                        std::copy(vars, vars + variables_num, std::begin(dice.control.s.value()));
-                        dice.reset();
-                        const autodiff::Value<Value> c = dice.economies[0].cca(dice.global.timestep_num - 1) - dice.global.fosslim;
+                        evaluate(vars, grad != nullptr, true);
                         if (grad) {
-                            std::copy(&c.derivative()[0], &c.derivative()[variables_num], grad);
+                            gather(&cached_constraint_grad[0], grad);
                         }
-                        return {c.value()};
+                        return {cached_constraint};
 #ifdef DEBUG
                     } catch (std::exception& e) {
                         std::cerr << "Exception '" << e.what() << "' in optimization" << std::endl;
@@ -212,25 +423,131 @@ void DICE<Value, Time>::run() {
                     }
 #endif
                 }
+
+                void jacobian_vector(const Value* vars, const Value* directions, size_t directions_num, Value* out) override {
+                    if (!directional_model) {
+                        return Optimization<Value, Time>::jacobian_vector(vars, directions, directions_num, out);
+                    }
+                    set_variables(*directional_model, vars);
+                    directional_model->utility_jacobian_vector(&scatter(directions, directions_num)[0], directions_num, out, model_variables_num);
+                }
+
+                void constraint_jacobian_vector(const Value* vars, const Value* directions, size_t directions_num, Value* out) override {
+                    if (!directional_model) {
+                        return Optimization<Value, Time>::constraint_jacobian_vector(vars, directions, directions_num, out);
+                    }
+                    set_variables(*directional_model, vars);
+                    directional_model->cca_constraint_jacobian_vector(&scatter(directions, directions_num)[0], directions_num, out, model_variables_num);
+                }
+
+                bool has_hessians() const override {
+                    return hessian_model != nullptr;
+                }
+
+                bool has_clones() const override {
+                    return clonable;
+                }
+
+                // Clones do without the directional model, falling back to projected gradients
+                std::unique_ptr<Optimization<Value, Time>> clone() override {
+                    std::vector<std::unique_ptr<ModelBase<Value, Time>>> models;
+                    models.push_back(model.clone());
+                    models.push_back(value_model.clone());
+                    if (hessian_model) {
+                        models.push_back(hessian_model->clone());
+                    }
+                    std::unique_ptr<DICEOptimization> res(new DICEOptimization(s_num, mu_first, indices, model_variables_num, objectives_num, constraints_num,
+                                                                               clonable, *models[0], *models[1], hessian_model ? models[2].get() : nullptr,
+                                                                               nullptr));
+                    res->lower_bounds = this->lower_bounds;
+                    res->upper_bounds = this->upper_bounds;
+                    res->owned_models = std::move(models);
+                    return std::unique_ptr<Optimization<Value, Time>>(res.release());
+                }
+
+                void hessian_vector(const Value* vars, const Value* v, Value* out) override {
+                    set_variables(*hessian_model, vars);
+                    std::vector<Value> res(model_variables_num);
+                    hessian_model->utility_hessian_vector(&scatter(v, 1)[0], &res[0], model_variables_num);
+                    gather(&res[0], out);
+                }
+
+                void constraint_hessian_vector(const Value* vars, const Value* v, Value* out) override {
+                    set_variables(*hessian_model, vars);
+                    std::vector<Value> res(model_variables_num);
+                    hessian_model->cca_constraint_hessian_vector(&scatter(v, 1)[0], &res[0], model_variables_num);
+                    gather(&res[0], out);
+                }
+
             };
 
-            const size_t optimization_variables_num = global.timestep_num - optimization_node["s_fix_steps"].as<Time>(0);
+            // The emission control rate of the first timestep is given (as mu0 in DICE)
+            const Time s_num = global.timestep_num - optimization_node["s_fix_steps"].as<Time>(0);
+            const Time mu_first = 1;
+            std::vector<size_t> indices;
+            for (Time t = 0; t < s_num; ++t) {
+                indices.push_back(model.control.s_index(t));
+            }
+            if (model.control.mu_variables) {
+                for (Time t = mu_first; t < global.timestep_num; ++t) {
+                    indices.push_back(model.control.mu_index(t));
+                }
+            }
             const size_t constraints_num = optimization_node["limit_cca"].as<bool>() ? 1 : 0;
             const bool verbose = optimization_node["verbose"].as<bool>();
-            DICEOptimization optimization{optimization_variables_num, 1, constraints_num, *this};
-            std::fill(std::begin(control.s.value()), std::end(control.s.value()), global.optlrsav);
-            TimeSeries<Value> initial_values(optimization_variables_num, 0);
+            std::unique_ptr<ModelBase<Value, Time>> optimization_model = create_optimization_model(optimization_node);
+            std::unique_ptr<ModelBase<Value, Time>> value_model = create_value_model();
+            std::vector<ModelBase<Value, Time>*> auxiliary_models{value_model.get()};
+            std::unique_ptr<ModelBase<Value, Time>> hessian_model;
+            if (optimization_node["hessians"].as<bool>(false)) {
+                hessian_model = create_hessian_model();
+                auxiliary_models.push_back(hessian_model.get());
+            }
+            std::unique_ptr<ModelBase<Value, Time>> directional_model;
+            if (optimization_node["seeded_directions"].as<bool>(false)) {
+                directional_model = create_directional_model();
+                auxiliary_models.push_back(directional_model.get());
+            }
+            // Models with forward-mode derivatives from the thread-local arena are bound to the thread using them (see autodiff::ArenaAllocator)
+            const bool clonable = optimization_node["derivatives"].as<std::string>("reverse") == "reverse";
+            DICEOptimization optimization{s_num,
+                                          mu_first,
+                                          std::move(indices),
+                                          model.control.variables_num,
+                                          1,
+                                          constraints_num,
+                                          clonable,
+                                          *optimization_model,
+                                          *value_model,
+                                          hessian_model.get(),
+                                          directional_model.get()};
+            for (size_t i = s_num; i < optimization.variables_num; ++i) {
+                optimization.upper_bounds[i] = model.economies[0].mu_upper(mu_first + i - s_num);
+            }
+            std::fill(std::begin(model.control.s.value()), std::end(model.control.s.value()), global.optlrsav);
+            TimeSeries<Value> initial_values(optimization.variables_num, 0);
 
-            single_optimization(optimization, optimization_node, initial_values, verbose);
+            single_optimization(optimization, *optimization_model, auxiliary_models, optimization_node, initial_values, s_num, mu_first, verbose);
         } else {
-            const size_t optimization_variables_num = global.timestep_num - 10;
-            const autodiff::Value<Value> utility = calc_single_utility();
+            const Time s_num = global.timestep_num - 10;
+            const Time mu_first = 1;
+            const ForwardValue utility = model.calc_single_utility();
+            const auto& derivative = utility.derivative();
             Value sum = 0;
-            for (size_t i = 0; i < optimization_variables_num; ++i) {
-                sum += utility.derivative()[i] * utility.derivative()[i];
+            for (Time t = 0; t < s_num; ++t) {
+                sum += derivative[model.control.s_index(t)] * derivative[model.control.s_index(t)];
             }
             std::cout << "Gradient length = " << std::sqrt(sum) << std::endl;
+            if (model.control.mu_variables) {
+                for (Time t = mu_first; t < global.timestep_num; ++t) {
+                    sum += derivative[model.control.mu_index(t)] * derivative[model.control.mu_index(t)];
+                }
+                std::cout << "Gradient length including mu = " << std::sqrt(sum) << std::endl;
+            }
             std::cout << "Finished with utility = " << utility.value() << std::endl;
+            if (settings.has("branches")) {
+                run_branches(settings["branches"]);
+            }
         }
     } else {
         throw std::runtime_error("multiple regions not supported yet");
@@ -239,21 +556,41 @@ void DICE<Value, Time>::run() {
 
 template<typename Value, typename Time>
 void DICE<Value, Time>::reset() {
-    emissions.reset();
-    climate->reset();
-    damage->reset();
-    for (auto&& economy : economies) {
-        economy.reset();
-    }
+    model.reset();
+}
+
+template<typename Value, typename Time>
+typename DICE<Value, Time>::Snapshot DICE<Value, Time>::snapshot(Time t) {
+    return model.snapshot(t);
+}
+
+template<typename Value, typename Time>
+void DICE<Value, Time>::restore(const Snapshot& snapshot) {
+    model.restore(*snapshot);
 }
 
 template<typename Value, typename Time>
-autodiff::Value<Value> DICE<Value, Time>::calc_single_utility() {
-    autodiff::Value<Value> utility{control.variables_num, 0};
-    for (Time t = 0; t < global.timestep_num; ++t) {
-        utility += economies[0].utility(t);
+void DICE<Value, Time>::run_branches(const settings::SettingsNode& branches_node) {
+    const Time from = branches_node["from"].as<Time>();
+    const Snapshot common = snapshot(from);
+    const std::vector<Value> mu = model.mu();
+    for (const auto& mu_node : branches_node["mu"].as_sequence()) {
+        const Value mu_after = mu_node.as<Value>();
+        restore(common);
+        std::fill(std::begin(model.mu()) + from + 1, std::end(model.mu()), mu_after);
+        const Value utility = model.calc_single_utility().value();
+#ifdef DEBUG
+        model.reset_all();
+        if (model.calc_single_utility().value() != utility) {
+            throw std::runtime_error("branch continued from snapshot differs from evaluation from the start");
+        }
+#endif
+        std::cout << "Branch with mu = " << mu_after << " after timestep " << from << ": utility = " << utility << std::endl;
     }
-    return global.scale1 * utility + global.scale2;
+    // Back to the control variables of the main run (e.g. for the output)
+    restore(common);
+    std::copy(std::begin(mu) + from + 1, std::end(mu), std::begin(model.mu()) + from + 1);
+    model.calc_single_utility();
 }
 
 template<typename Value, typename Time>
@@ -278,7 +615,7 @@ void DICE<Value, Time>::output() {
 #ifdef DICEPP_WITH_NETCDF
 template<typename Value, typename Time>
 void DICE<Value, Time>::write_netcdf_output(const settings::SettingsNode& output_node) {
-    if (economies.size() == 1) {
+    if (model.economies.size() == 1) {
         netCDF::NcFile file(output_node["filename"].as<std::string>(), netCDF::NcFile::replace, netCDF::NcFile::nc4);
 
         netCDF::NcDim time_dim = file.addDim("time", global.timestep_num);
@@ -287,7 +624,7 @@ void DICE<Value, Time>::write_netcdf_output(const settings::SettingsNode& output
             const Time year = global.start_year + t * global.timestep_length;
             time_var.putVar({t}, (const unsigned int)year);
         }
-        class NetCDFOutputObserver : public Observer<autodiff::Value<Value>, Time, Value> {
+        class NetCDFOutputObserver : public Observer<ForwardValue, Time, Value> {
           protected:
             const netCDF::NcGroup& group;
             const netCDF::NcDim& time_dim;
@@ -307,12 +644,8 @@ void DICE<Value, Time>::write_netcdf_output(const settings::SettingsNode& output
             }
         };
         NetCDFOutputObserver observer(file, time_dim, output_node);
-        economies[0].observe(observer);
-        climate->observe(observer);
-        damage->observe(observer);
-        control.observe(observer);
-        emissions.observe(observer);
-        file.putAtt("utility", netCDF::NcType::nc_FLOAT, calc_single_utility().value());
+        model.observe(observer);
+        file.putAtt("utility", netCDF::NcType::nc_FLOAT, model.calc_single_utility().value());
     } else {
         throw std::runtime_error("multiple regions not supported yet");
     }
@@ -321,14 +654,14 @@ void DICE<Value, Time>::write_netcdf_output(const settings::SettingsNode& output
 
 template<typename Value, typename Time>
 void DICE<Value, Time>::write_csv_output(const settings::SettingsNode& output_node) {
-    if (economies.size() == 1) {
+    if (model.economies.size() == 1) {
         const std::string& filename = output_node["filename"].as<std::string>();
         std::ofstream file(filename);
         if (!file) {
             throw std::runtime_error("could not write to '" + filename + "'");
         }
 
-        class CSVOutputObserver : public Observer<autodiff::Value<Value>, Time, Value> {
+        class CSVOutputObserver : public Observer<ForwardValue, Time, Value> {
           protected:
             std::ofstream& file;
 
@@ -340,7 +673,7 @@ void DICE<Value, Time>::write_csv_output(const settings::SettingsNode& output_no
             std::tuple<bool, bool, Time> want(const std::string& name) override {
                 return std::tuple<bool, bool, Time>(name == var, false, t);
             }
-            bool observe(const std::string& name, const autodiff::Value<Value>& v) override {
+            bool observe(const std::string& name, const ForwardValue& v) override {
                 file << v.value();
                 return false;
             }
@@ -366,7 +699,7 @@ void DICE<Value, Time>::write_csv_output(const settings::SettingsNode& output_no
             file << "\"" << (*var).as<std::string>() << "\"";
         }
         file << "\n";
-        const auto utility = calc_single_utility();
+        const auto utility = model.calc_single_utility();
         const auto& dev = utility.derivative();
         for (Time t = 0; t < global.timestep_num; ++t) {
             observer.t = t;
@@ -382,11 +715,15 @@ void DICE<Value, Time>::write_csv_output(const settings::SettingsNode& output_no
                 } else if (name == "utility") {
                     file << utility.value();
                 } else if (name == "gradient") {
-                    file << dev[t];
+                    file << dev[model.control.s_index(t)];
+                } else if (name == "gradient_mu") {
+                    if (!model.control.mu_variables) {
+                        throw std::runtime_error("variable '" + name + "' only available with optimize_mu");
+                    }
+                    file << dev[model.control.mu_index(t)];
                 } else {
                     observer.var = name;
-                    if (economies[0].observe(observer) && climate->observe(observer) && damage->observe(observer) && control.observe(observer)
-                        && emissions.observe(observer)) {
+                    if (model.observe(observer)) {
                         throw std::runtime_error("variable '" + name + "' not found");
                     }
                 }
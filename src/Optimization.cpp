@@ -18,7 +18,15 @@
 */
 
 #include "Optimization.h"
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <sstream>
 #include "DICE.h"
+#include "WorkStealingPool.h"
 #include "settingsnode.h"
 
 #pragma GCC diagnostic push
@@ -121,13 +129,31 @@ static const char* get_optimization_results(const int& result_) {
 static Optimization<double, size_t>* optimization;
 #endif
 
+template<typename Value, typename Time>
+void Optimization<Value, Time>::project_gradient(const Value* grad, const Value* directions, size_t directions_num, Value* out) const {
+    for (size_t j = 0; j < directions_num; ++j) {
+        out[j] = std::inner_product(grad, grad + variables_num, directions + j * variables_num, Value(0));
+    }
+}
+
+template<typename Value, typename Time>
+void Optimization<Value, Time>::assemble_hessian(void (Optimization::*hessian_vector_p)(const Value*, const Value*, Value*), const Value* vars, Value* out) {
+    // Hessians are symmetric, so the product with the i-th unit vector is the i-th row as well
+    std::vector<Value> unit(variables_num, 0);
+    for (size_t i = 0; i < variables_num; ++i) {
+        unit[i] = 1;
+        (this->*hessian_vector_p)(vars, &unit[0], out + i * variables_num);
+        unit[i] = 0;
+    }
+}
+
 template<typename Value, typename Time>
 void Optimization<Value, Time>::optimize(const settings::SettingsNode& settings, TimeSeries<Value>& initial_values, bool verbose) {
     const std::string& library = settings["library"].as<std::string>();
     if (library == "midaco") {
 #ifdef DICEPP_WITH_MIDACO
         long int o, n, ni, m, me, maxeval, maxtime, printeval, save2file, iflag = 0, istop = 0;
-        std::vector<double> x(initial_values), xl(variables_num, 0), xu(variables_num, 1), param(12);
+        std::vector<double> x(initial_values), xl(lower_bounds), xu(upper_bounds), param(12);
         char key[] = "MIDACO_LIMITED_VERSION___[CREATIVE_COMMONS_BY-NC-ND_LICENSE]";
 
         o = 1;              // Number of objectives
@@ -181,8 +207,21 @@ void Optimization<Value, Time>::optimize(const settings::SettingsNode& settings,
 #endif
     } else if (library == "pagmo") {
 #ifdef DICEPP_WITH_PAGMO
+        // Copies of the problem (as made by pagmo, e.g. for every island) evaluate clones of the optimization if it has them, and can then be used
+        // from several threads at once
         struct PagmoProblem {
-            Optimization<Value, Time>* optimization;
+            std::shared_ptr<Optimization<Value, Time>> optimization;
+            std::shared_ptr<std::mutex> clone_mutex;  // Cloning reads the settings, hence one clone at a time
+            PagmoProblem() = default;
+            explicit PagmoProblem(Optimization<Value, Time>* optimization_p)
+                : optimization(optimization_p, [](Optimization<Value, Time>*) {}), clone_mutex(std::make_shared<std::mutex>()){};
+            PagmoProblem(const PagmoProblem& other) : optimization(other.optimization), clone_mutex(other.clone_mutex) {
+                if (optimization && optimization->has_clones()) {
+                    std::lock_guard<std::mutex> lock(*clone_mutex);
+                    optimization = other.optimization->clone();
+                }
+            }
+            PagmoProblem(PagmoProblem&& other) = default;
             pagmo::vector_double fitness(const pagmo::vector_double& vars) const {
                 pagmo::vector_double f(optimization->objectives_num + optimization->constraints_num);
                 f[0] = -optimization->objective(&vars[0], nullptr)[0];  // TODO
@@ -192,21 +231,48 @@ void Optimization<Value, Time>::optimize(const settings::SettingsNode& settings,
                 return f;
             }
             std::pair<pagmo::vector_double, pagmo::vector_double> get_bounds() const {
-                pagmo::vector_double lb(optimization->variables_num, 0);
-                pagmo::vector_double ub(optimization->variables_num, 1);
-                return {lb, ub};
+                return {optimization->lower_bounds, optimization->upper_bounds};
             }
             bool has_gradient() const {
                 return true;
             }
+            // Dense gradients of the fitness components one after the other
             pagmo::vector_double gradient(const pagmo::vector_double& vars) const {
-                pagmo::vector_double grad(optimization->objectives_num + optimization->constraints_num);
-                optimization->objective(&vars[0], &grad[0])[0];  // TODO
+                const size_t n = optimization->variables_num;
+                pagmo::vector_double grad((optimization->objectives_num + optimization->constraints_num) * n);
+                optimization->objective(&vars[0], &grad[0]);
+                std::transform(std::begin(grad), std::begin(grad) + n, std::begin(grad), [](double g) { return -g; });
                 if (optimization->constraints_num > 0) {
-                    optimization->constraint(&vars[0], nullptr)[0];  // TODO
+                    optimization->constraint(&vars[0], &grad[n]);
                 }
                 return grad;
             }
+            bool has_hessians() const {
+                return optimization->has_hessians();
+            }
+            // Lower triangles of the dense Hessians (in pagmo's default sparsity pattern) for each fitness component
+            std::vector<pagmo::vector_double> hessians(const pagmo::vector_double& vars) const {
+                const size_t n = optimization->variables_num;
+                std::vector<pagmo::vector_double> res;
+                std::vector<Value> hessian(n * n);
+                optimization->hessian(&vars[0], &hessian[0]);
+                res.emplace_back(lower_triangle(hessian, n, -1));
+                if (optimization->constraints_num > 0) {
+                    optimization->constraint_hessian(&vars[0], &hessian[0]);
+                    res.emplace_back(lower_triangle(hessian, n, 1));
+                }
+                return res;
+            }
+            static pagmo::vector_double lower_triangle(const std::vector<Value>& hessian, size_t n, Value factor) {
+                pagmo::vector_double res;
+                res.reserve(n * (n + 1) / 2);
+                for (size_t i = 0; i < n; ++i) {
+                    for (size_t j = 0; j <= i; ++j) {
+                        res.push_back(factor * hessian[i * n + j]);
+                    }
+                }
+                return res;
+            }
             pagmo::vector_double::size_type get_nobj() const {
                 return optimization->objectives_num;
             }
@@ -217,17 +283,16 @@ void Optimization<Value, Time>::optimize(const settings::SettingsNode& settings,
                 return optimization->constraints_num;
             }
             pagmo::thread_safety get_thread_safety() const {
-                return pagmo::thread_safety::none;
+                return optimization->has_clones() ? pagmo::thread_safety::basic : pagmo::thread_safety::none;
             }
         };
-        PagmoProblem pagmo_problem;
-        pagmo_problem.optimization = this;
-        pagmo::problem problem{pagmo_problem};
-        pagmo::population population{problem};
-        population.push_back(initial_values);
         pagmo::algorithm algorithm;
+        bool population_based = false;
 
         const std::string& solver_name = settings["solver"].as<std::string>();
+        const unsigned seed = settings["seed"].as<unsigned>(pagmo::random_device::next());
+        // Generations evolved by the population-based solvers per evolution, i.e. between migrations of an archipelago
+        const unsigned migration_interval = settings["migration_interval"].as<unsigned>(1);
         if (solver_name == "ipopt") {
             pagmo::ipopt solver;
             solver.set_numeric_option("tol", settings["utility_precision"].as<Value>() / 3000);
@@ -249,13 +314,76 @@ void Optimization<Value, Time>::optimize(const settings::SettingsNode& settings,
                 solver.set_maxtime(settings["timeout"].as<size_t>());
             }
             algorithm = pagmo::algorithm{solver};
+        } else if (solver_name == "sade") {
+            algorithm = pagmo::algorithm{pagmo::sade(migration_interval, 2u, 1u, 1e-6, 1e-6, false, seed)};
+            population_based = true;
+        } else if (solver_name == "de") {
+            algorithm = pagmo::algorithm{pagmo::de(migration_interval, 0.8, 0.9, 2u, 1e-6, 1e-6, seed)};
+            population_based = true;
+        } else if (solver_name == "cmaes") {
+            algorithm = pagmo::algorithm{pagmo::cmaes(migration_interval, -1, -1, -1, -1, 0.5, 1e-6, 1e-6, false, true, seed)};
+            population_based = true;
         } else {
             throw std::runtime_error("unknown solver '" + solver_name + "'");
         }
-        for (size_t i = 0; i < settings["iterations"].as<size_t>(1); ++i) {
-            population = algorithm.evolve(population);
+
+        pagmo::problem problem{PagmoProblem(this)};
+        if (population_based && constraints_num > 0) {
+            // The population-based solvers only handle unconstrained problems
+            problem = pagmo::problem{pagmo::unconstrain{PagmoProblem(this), settings["constraint_handling"].as<std::string>("kuri")}};
+        }
+        const size_t population_size = settings["population_size"].as<size_t>(population_based ? 20 : 1);
+        const size_t islands = settings["islands"].as<size_t>(1);
+        pagmo::vector_double vars;
+        if (islands <= 1) {
+            pagmo::population population{problem, population_size - 1, seed};
+            population.push_back(initial_values);
+            for (size_t i = 0; i < settings["iterations"].as<size_t>(1); ++i) {
+                population = algorithm.evolve(population);
+            }
+            vars = population.champion_x();
+        } else {
+            // Islands evolve concurrently in threads, exchanging individuals along the topology after every evolution. Otherwise pagmo would evolve
+            // them in forked processes, which needs problems it can serialize
+            if (algorithm.get_thread_safety() < pagmo::thread_safety::basic || problem.get_thread_safety() < pagmo::thread_safety::basic) {
+                throw std::runtime_error("islands need a thread-safe solver (not ipopt) and clonable models (reverse-mode derivatives)");
+            }
+            const std::string& topology_name = settings["topology"].as<std::string>("ring");
+            pagmo::topology topology;
+            if (topology_name == "ring") {
+                topology = pagmo::topology{pagmo::ring{}};
+            } else if (topology_name == "fully_connected") {
+                topology = pagmo::topology{pagmo::fully_connected{}};
+            } else if (topology_name == "unconnected") {
+                topology = pagmo::topology{pagmo::unconnected{}};
+            } else {
+                throw std::runtime_error("unknown topology '" + topology_name + "'");
+            }
+            pagmo::archipelago archipelago{topology};
+            for (size_t i = 0; i < islands; ++i) {
+                // The initial values start on the first island only, the others start from random individuals
+                pagmo::population population{problem, i == 0 ? population_size - 1 : population_size, seed + static_cast<unsigned>(i)};
+                if (i == 0) {
+                    population.push_back(initial_values);
+                }
+                archipelago.push_back(algorithm, population);
+            }
+            archipelago.evolve(settings["iterations"].as<unsigned>(1));
+            archipelago.wait_check();
+            // Best of the champions of the islands, feasible ones first
+            pagmo::vector_double best_f;
+            for (const auto& island : archipelago) {
+                const pagmo::population population = island.get_population();
+                if (verbose) {
+                    std::cout << "Island champion utility = " << -population.champion_f()[0] << std::endl;
+                }
+                if (best_f.empty() || pagmo::compare_fc(population.champion_f(), best_f, problem.get_nec(), problem.get_c_tol())) {
+                    best_f = population.champion_f();
+                    vars = population.champion_x();
+                }
+            }
         }
-        pagmo::vector_double vars = population.champion_x();
+        initial_values = vars;
         objective(&vars[0], nullptr);
 #else
         throw std::runtime_error("library '" + library + "' not supported by this binary");
@@ -275,7 +403,7 @@ void Optimization<Value, Time>::optimize(const settings::SettingsNode& settings,
         });
 
         for (Time t = 0; t < variables_num; ++t) {
-            BORG_Problem_set_bounds(opt, t, 0, 1);
+            BORG_Problem_set_bounds(opt, t, lower_bounds[t], upper_bounds[t]);
         }
 
         BORG_Problem_set_epsilon(opt, 0, settings["utility_precision"].as<Value>());
@@ -376,7 +504,7 @@ void Optimization<Value, Time>::optimize(const settings::SettingsNode& settings,
                     Optimization<Value, Time>* optimization = static_cast<Optimization<Value, Time>*>(data);
                     return optimization->constraint(x, grad)[0];  // TODO
                 },
-                this, 0.1);
+                this, constraint_tolerance);
         }
         opt.set_max_objective(
             [](unsigned n, const double* x, double* grad, void* data) {
@@ -391,8 +519,8 @@ void Optimization<Value, Time>::optimize(const settings::SettingsNode& settings,
         if (settings.has("rel_var_precision")) {
             opt.set_xtol_rel(settings["rel_var_precision"].as<Value>());
         }
-        opt.set_lower_bounds(std::vector<Value>(variables_num, 0));
-        opt.set_upper_bounds(std::vector<Value>(variables_num, 1));
+        opt.set_lower_bounds(lower_bounds);
+        opt.set_upper_bounds(upper_bounds);
         if (settings.has("maxiter")) {
             opt.set_maxeval(settings["maxiter"].as<size_t>());
         }
@@ -401,7 +529,14 @@ void Optimization<Value, Time>::optimize(const settings::SettingsNode& settings,
         }
 
         Value utility;
-        nlopt::result result = opt.optimize(initial_values, utility);
+        nlopt::result result;
+        try {
+            result = opt.optimize(initial_values, utility);
+        } catch (const nlopt::roundoff_limited&) {
+            // Thrown by the C++ interface of NLopt (e.g. often by SLSQP) although initial_values still holds a useful result, which should
+            // neither end the run nor the other starts of a multistart
+            result = nlopt::ROUNDOFF_LIMITED;
+        }
         if (verbose) {
             std::cout << get_optimization_results(result) << std::endl;
         }
@@ -413,5 +548,100 @@ void Optimization<Value, Time>::optimize(const settings::SettingsNode& settings,
     }
 }
 
+template<typename Value, typename Time>
+size_t Optimization<Value, Time>::multistart(const settings::SettingsNode& settings,
+                                             std::vector<TimeSeries<Value>>& starts,
+                                             size_t threads,
+                                             bool verbose) {
+    if (starts.empty()) {
+        throw std::runtime_error("no starts given");
+    }
+    if (objectives_num != 1) {
+        throw std::runtime_error("multistart only supports a single objective");
+    }
+    const std::string& library = settings["library"].as<std::string>();
+    if (!has_clones() || (library != "nlopt" && library != "pagmo")) {  // the other libraries keep global state
+        threads = 1;
+    }
+    threads = std::max<size_t>(1, std::min(threads, starts.size()));
+    // Worker 0 (the calling thread) uses this instance, the other workers a clone and a copy of the settings of their own each (as even reading
+    // the same settings is not thread-safe); both are made here, before any worker starts
+    std::vector<std::unique_ptr<Optimization>> clones;
+    std::vector<settings::SettingsNode> worker_settings;
+    std::ostringstream settings_yaml;
+    settings_yaml << settings;
+    for (size_t i = 1; i < threads; ++i) {
+        clones.push_back(clone());
+        std::istringstream stream(settings_yaml.str());
+        worker_settings.emplace_back(stream);
+    }
+
+    std::vector<Value> utilities(starts.size());
+    std::vector<Value> constraints(starts.size(), 0);
+    WorkStealingPool pool(threads);
+    for (size_t k = 0; k < starts.size(); ++k) {
+        pool.add([&, k](size_t worker) {
+            Optimization& optimization = worker == 0 ? *this : *clones[worker - 1];
+            optimization.optimize(worker == 0 ? settings : worker_settings[worker - 1], starts[k], false);
+            utilities[k] = optimization.objective(&starts[k][0], nullptr)[0];
+            if (constraints_num > 0) {
+                // Largest constraint value, i.e. the strongest violation if any
+                const std::vector<Value> c = optimization.constraint(&starts[k][0], nullptr);
+                constraints[k] = *std::max_element(std::begin(c), std::end(c));
+            }
+        });
+    }
+    pool.run();
+
+    size_t best = 0;
+    size_t feasible_num = 0;
+    for (size_t k = 0; k < starts.size(); ++k) {
+        const bool feasible = constraints[k] <= constraint_tolerance;
+        const bool best_feasible = constraints[best] <= constraint_tolerance;
+        if (feasible) {
+            ++feasible_num;
+        }
+        if ((feasible && (!best_feasible || utilities[k] > utilities[best])) || (!feasible && !best_feasible && constraints[k] < constraints[best])) {
+            best = k;
+        }
+    }
+
+    if (verbose) {
+        for (size_t k = 0; k < starts.size(); ++k) {
+            std::cout << "Start " << k << ": utility = " << utilities[k];
+            if (constraints_num > 0) {
+                std::cout << ", constraint = " << constraints[k] << (constraints[k] <= constraint_tolerance ? "" : " (infeasible)");
+            }
+            std::cout << std::endl;
+        }
+        // Spread of the local optima found
+        std::vector<Value> sorted(utilities);
+        std::sort(std::begin(sorted), std::end(sorted));
+        const Value mean = std::accumulate(std::begin(sorted), std::end(sorted), Value(0)) / sorted.size();
+        Value variance = 0;
+        for (const auto& utility : sorted) {
+            variance += (utility - mean) * (utility - mean);
+        }
+        variance /= sorted.size();
+        const size_t n = sorted.size();
+        const Value median = n % 2 == 1 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+        Value max_distance = 0;  // of the feasible solutions to the best one (in the maximum norm)
+        for (size_t k = 0; k < starts.size(); ++k) {
+            if (constraints[k] <= constraint_tolerance) {
+                for (size_t i = 0; i < variables_num; ++i) {
+                    max_distance = std::max(max_distance, std::abs(starts[k][i] - starts[best][i]));
+                }
+            }
+        }
+        std::cout << "Multistart on " << threads << " threads: " << feasible_num << " of " << n << " solutions feasible, best utility = " << utilities[best]
+                  << " (start " << best << "), median = " << median << ", worst = " << sorted[0] << ", standard deviation = " << std::sqrt(variance)
+                  << ", max. distance to best = " << max_distance << std::endl;
+    }
+
+    // The models of this instance were last evaluated for the last start run by worker 0, so they are set back to the best one
+    objective(&starts[best][0], nullptr);
+    return best;
+}
+
 template class Optimization<double, size_t>;
 }